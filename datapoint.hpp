@@ -2,41 +2,54 @@
 #define _DATAPOINT_H
 
 #include <cmath>
+#include <array>
 #include "defs.hpp"
 
 using namespace std;
 
+/* a hash value of W 64-bit words */
+template<int W>
+using HashValue = array<unsigned long long, W>;
+
+template<int W>
 struct DataPoint {
 	long long id;
-	unsigned long long value;
+	HashValue<W> value;
 	bool active;
 
-	DataPoint():id(0),active(true){}
+	DataPoint():id(0),value(),active(true){}
 	
-	DataPoint(const long long id, const double value):id(id),value(value),active(true){}
+	DataPoint(const long long id, const HashValue<W> &value):id(id),value(value),active(true){}
+
+	DataPoint(const long long id, const unsigned long long *words):id(id),active(true){
+		for (int k=0;k<W;k++) value[k] = words[k];
+	}
 
 	DataPoint(const DataPoint &other){
+		id = other.id;
 		active = other.active;
 		value = other.value;
 	}
 	
 	DataPoint& operator=(const DataPoint &other){
+		id = other.id;
 		active = other.active;
 		value = other.value;
 		return *this;
 	}
 };
 
+template<typename D>
 struct QueryResult {
-	DataPoint *dp;
-	double distance;
-	QueryResult():dp(NULL),distance(0){};
+	long long id;
+	D distance;
+	QueryResult():id(0),distance(0){};
 	QueryResult(const QueryResult &other){
-		dp = other.dp;
+		id = other.id;
 		distance = other.distance;
 	}
 	QueryResult& operator=(const QueryResult &other){
-		dp = other.dp;
+		id = other.id;
 		distance = other.distance;
 		return *this;
 	}
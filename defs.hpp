@@ -10,6 +10,34 @@
                              /* bf^(levelspernode-1)                                     */
 #define MVP_FANOUT 64         /* number child nodes to internal node: bf^(levelspernode)  */
 
+#define MVP_LEAFMASKWORDS ((MVP_LEAFCAP+63)/64) /* 64-bit words for bitmask over leaf points */
+
+#define MVP_CACHELINE 64      /* alignment of leaf point arrays */
+
+#define MVP_STACKSIZE 1024    /* node offsets held inline in a query's traversal stack */
+#define MVP_PATHDEPTH 64      /* max. depth in nodes at which leaves are filtered on path distances */
+#define MVP_LEAFPATH 2        /* no. nearest ancestors whose vantage points leaf points keep distances to */
+
+#define MVP_PREFETCHDIST 4    /* default no. nodes ahead of a query's traversal to prefetch, 0 for none */
+#define MVP_PREFETCHLINES 64  /* max. cache lines of a node's record to prefetch */
+
+/* hash widths supported, in 64-bit words: 64, 128, 256 and 576 bits */
+#define MVP_FOR_EACH_HASH_WORDS(X) X(1) X(2) X(4) X(9)
+#define MVP_MAXHASHWORDS 9
+
+#define MVP_VPCANDIDATES 8    /* default no. points tried for each vantage point, 0 to take arrival order */
+#define MVP_VPSAMPLE 32       /* no. points over which a vantage point candidate's spread is measured */
+
 #define MVP_SYNC 500         /* max. queue size before triggering adding it to the tree */
 
+#define MVP_BUILDTHREADS 0    /* default no. threads to build large batches on, 0 for one per core */
+#define MVP_PARALLELMIN 20000 /* min. no. points in a batch for it to be built in parallel */
+#define MVP_TASKMIN 2000      /* min. no. points in a subtree for it to be built as a separate task */
+
+#define MVP_REBUILDMIN 10000  /* min. no. points in a subtree for it to be rebuilt when unbalanced */
+#define MVP_IMBALANCE 2       /* times its even share of a node's points a child may hold before rebuilding */
+#define MVP_REBUILDSLICE 5    /* default ms. of rebuild work done on each batch added, 0 for none */
+#define MVP_REBUILDCHUNK 1024 /* max. no. points handled in one step of a rebuild */
+#define MVP_DISCARDCHUNK 64   /* max. no. nodes of a replaced subtree deleted in one step */
+
 #endif /* _DEFS_H */
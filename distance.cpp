@@ -0,0 +1,253 @@
+#include <cstdlib>
+#include <algorithm>
+#include "distance.hpp"
+
+using namespace std;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+typedef void (*HammingFunc)(const unsigned long long*, const unsigned long long*, const int, const int, int*);
+typedef void (*PivotFunc)(const unsigned char*, const int, const int, const int, unsigned long long*);
+
+struct Kernels {
+	const char *name;
+	HammingFunc hamming;
+	PivotFunc pivot;
+};
+
+/* clear bits [0,n) of mask */
+static void ClearMask(const int n, unsigned long long *mask){
+	for (int j=0;j<n;j+=64){
+		mask[j/64] &= (n - j >= 64) ? 0ULL : ~((1ULL << (n-j)) - 1);
+	}
+}
+
+/********** scalar kernels ***********************/
+
+static void HammingDistancesScalar(const unsigned long long *target, const unsigned long long *values,
+								   const int words, const int n, int *dists){
+	for (int i=0;i<n;i++){
+		int d = 0;
+		for (int k=0;k<words;k++) d += __builtin_popcountll(target[k]^values[i*words+k]);
+		dists[i] = d;
+	}
+}
+
+static void PivotFilterScalar(const unsigned char *pdists, const int n, const int lo, const int hi,
+							  unsigned long long *mask){
+	for (int j=0;j<n;j++){
+		if (pdists[j] < lo || pdists[j] > hi)
+			mask[j/64] &= ~(1ULL << (j%64));
+	}
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/********** avx2 kernels *************************/
+
+/* popcount of each 64-bit lane, by nibble lookup table with the byte */
+/* counts summed by psadbw                                            */
+__attribute__((target("avx2")))
+static inline __m256i PopCount64AVX2(const __m256i v){
+	const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+										 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+	const __m256i lowmask = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(v, lowmask);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowmask);
+	__m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo), _mm256_shuffle_epi8(lut, hi));
+	return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+/* single word hashes, four to a vector */
+__attribute__((target("avx2")))
+static void HammingDistances1AVX2(const unsigned long long target, const unsigned long long *values,
+								  const int n, int *dists){
+	const __m256i lanes = _mm256_setr_epi32(0,2,4,6,0,0,0,0);
+	const __m256i t = _mm256_set1_epi64x((long long)target);
+
+	int i = 0;
+	for ( ;i+4<=n;i+=4){
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(values+i)), t);
+		__m256i sums = _mm256_permutevar8x32_epi32(PopCount64AVX2(v), lanes);
+		_mm_storeu_si128((__m128i*)(dists+i), _mm256_castsi256_si128(sums));
+	}
+	for ( ;i<n;i++){
+		dists[i] = __builtin_popcountll(target^values[i]);
+	}
+}
+
+/* two word hashes, two to a vector */
+__attribute__((target("avx2")))
+static void HammingDistances2AVX2(const unsigned long long *target, const unsigned long long *values,
+								  const int n, int *dists){
+	const __m256i t = _mm256_setr_epi64x((long long)target[0], (long long)target[1],
+										 (long long)target[0], (long long)target[1]);
+	int i = 0;
+	for ( ;i+2<=n;i+=2){
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(values+2*i)), t);
+		__m256i sums = PopCount64AVX2(v);
+		sums = _mm256_add_epi64(sums, _mm256_srli_si256(sums, 8));
+		dists[i] = _mm256_extract_epi32(sums, 0);
+		dists[i+1] = _mm256_extract_epi32(sums, 4);
+	}
+	for ( ;i<n;i++){
+		dists[i] = __builtin_popcountll(target[0]^values[2*i]) + __builtin_popcountll(target[1]^values[2*i+1]);
+	}
+}
+
+/* wider hashes, four words of a hash at a time */
+__attribute__((target("avx2")))
+static void HammingDistancesNAVX2(const unsigned long long *target, const unsigned long long *values,
+								  const int words, const int n, int *dists){
+	for (int i=0;i<n;i++){
+		const unsigned long long *value = values + i*words;
+		__m256i acc = _mm256_setzero_si256();
+		int k = 0;
+		for ( ;k+4<=words;k+=4){
+			__m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(value+k)),
+										 _mm256_loadu_si256((const __m256i*)(target+k)));
+			acc = _mm256_add_epi64(acc, PopCount64AVX2(v));
+		}
+		__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		int d = _mm_cvtsi128_si32(sum) + _mm_extract_epi32(sum, 2);
+		for ( ;k<words;k++) d += __builtin_popcountll(target[k]^value[k]);
+		dists[i] = d;
+	}
+}
+
+__attribute__((target("avx2")))
+static void HammingDistancesAVX2(const unsigned long long *target, const unsigned long long *values,
+								 const int words, const int n, int *dists){
+	switch (words){
+	case 1: HammingDistances1AVX2(target[0], values, n, dists); break;
+	case 2: HammingDistances2AVX2(target, values, n, dists); break;
+	default: HammingDistancesNAVX2(target, values, words, n, dists);
+	}
+}
+
+/* kept where lo <= p <= hi, by (lo - p) and (p - hi) saturating to zero */
+__attribute__((target("avx2")))
+static void PivotFilterAVX2(const unsigned char *pdists, const int n, const int lo, const int hi,
+							unsigned long long *mask){
+	if (lo > hi || lo > 255 || hi < 0){
+		ClearMask(n, mask);
+		return;
+	}
+	if (lo <= 0 && hi >= 255) return;
+
+	const __m256i l = _mm256_set1_epi8((char)max(lo, 0));
+	const __m256i h = _mm256_set1_epi8((char)min(hi, 255));
+	const __m256i zero = _mm256_setzero_si256();
+
+	int j = 0;
+	for ( ;j+32<=n;j+=32){
+		__m256i p = _mm256_loadu_si256((const __m256i*)(pdists+j));
+		__m256i out = _mm256_or_si256(_mm256_subs_epu8(l, p), _mm256_subs_epu8(p, h));
+		unsigned long long drop = (unsigned int)~_mm256_movemask_epi8(_mm256_cmpeq_epi8(out, zero));
+		mask[j/64] &= ~(drop << (j%64));
+	}
+	for ( ;j<n;j++){
+		if (pdists[j] < lo || pdists[j] > hi)
+			mask[j/64] &= ~(1ULL << (j%64));
+	}
+}
+
+/********** avx512 kernels ***********************/
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void HammingDistances1AVX512(const unsigned long long target, const unsigned long long *values,
+									const int n, int *dists){
+	const __m512i t = _mm512_set1_epi64((long long)target);
+
+	int i = 0;
+	for ( ;i+8<=n;i+=8){
+		__m512i v = _mm512_xor_si512(_mm512_loadu_si512((const void*)(values+i)), t);
+		_mm256_storeu_si256((__m256i*)(dists+i), _mm512_cvtepi64_epi32(_mm512_popcnt_epi64(v)));
+	}
+	if (i < n){
+		__mmask8 k = (__mmask8)((1U << (n-i)) - 1);
+		__m512i v = _mm512_xor_si512(_mm512_maskz_loadu_epi64(k, (const void*)(values+i)), t);
+		_mm512_mask_cvtepi64_storeu_epi32((void*)(dists+i), k, _mm512_popcnt_epi64(v));
+	}
+}
+
+/* wider hashes, up to eight words of a hash at a time */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void HammingDistancesNAVX512(const unsigned long long *target, const unsigned long long *values,
+									const int words, const int n, int *dists){
+	for (int i=0;i<n;i++){
+		const unsigned long long *value = values + i*words;
+		__m512i acc = _mm512_setzero_si512();
+		for (int k=0;k<words;k+=8){
+			__mmask8 m = (words - k >= 8) ? 0xff : (__mmask8)((1U << (words-k)) - 1);
+			__m512i v = _mm512_xor_si512(_mm512_maskz_loadu_epi64(m, (const void*)(value+k)),
+										 _mm512_maskz_loadu_epi64(m, (const void*)(target+k)));
+			acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+		}
+		dists[i] = (int)_mm512_reduce_add_epi64(acc);
+	}
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static void HammingDistancesAVX512(const unsigned long long *target, const unsigned long long *values,
+								   const int words, const int n, int *dists){
+	if (words == 1) HammingDistances1AVX512(target[0], values, n, dists);
+	else HammingDistancesNAVX512(target, values, words, n, dists);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void PivotFilterAVX512(const unsigned char *pdists, const int n, const int lo, const int hi,
+							  unsigned long long *mask){
+	if (lo > hi || lo > 255 || hi < 0){
+		ClearMask(n, mask);
+		return;
+	}
+	if (lo <= 0 && hi >= 255) return;
+
+	const __m512i l = _mm512_set1_epi8((char)max(lo, 0));
+	const __m512i h = _mm512_set1_epi8((char)min(hi, 255));
+
+	for (int j=0;j<n;j+=64){
+		__mmask64 k = (n - j >= 64) ? ~0ULL : (1ULL << (n-j)) - 1;
+		__m512i p = _mm512_maskz_loadu_epi8(k, (const void*)(pdists+j));
+		mask[j/64] &= (_mm512_cmpge_epu8_mask(p, l) & _mm512_cmple_epu8_mask(p, h)) | ~k;
+	}
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+/********** runtime dispatch *********************/
+
+static Kernels SelectKernels(){
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+		&& __builtin_cpu_supports("avx512vpopcntdq"))
+		return {"avx512", HammingDistancesAVX512, PivotFilterAVX512};
+	if (__builtin_cpu_supports("avx2"))
+		return {"avx2", HammingDistancesAVX2, PivotFilterAVX2};
+#endif
+	return {"scalar", HammingDistancesScalar, PivotFilterScalar};
+}
+
+static const Kernels& GetKernels(){
+	static const Kernels kernels = SelectKernels();
+	return kernels;
+}
+
+void HammingDistances(const unsigned long long *target, const unsigned long long *values,
+					  const int words, const int n, int *dists){
+	GetKernels().hamming(target, values, words, n, dists);
+}
+
+void PivotFilter(const unsigned char *pdists, const int n, const int lo, const int hi,
+				 unsigned long long *mask){
+	GetKernels().pivot(pdists, n, lo, hi, mask);
+}
+
+const char* DistanceKernelName(){
+	return GetKernels().name;
+}
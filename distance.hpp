@@ -0,0 +1,21 @@
+#ifndef _DISTANCE_H
+#define _DISTANCE_H
+
+/* Batched hamming distance kernels for hashes of one or more 64-bit      */
+/* words.  Implementations using avx512 (vpopcntq), avx2 or plain scalar  */
+/* code are selected at runtime according to what the cpu supports.       */
+
+/* dists[i] = popcount(target ^ values[i]) for i in [0,n), where target and */
+/* each of the n values are hashes of words 64-bit words, values held one  */
+/* after the other                                                         */
+void HammingDistances(const unsigned long long *target, const unsigned long long *values,
+					  const int words, const int n, int *dists);
+
+/* clear bit j of mask, for j in [0,n), wherever pdists[j] is outside [lo,hi] */
+void PivotFilter(const unsigned char *pdists, const int n, const int lo, const int hi,
+				 unsigned long long *mask);
+
+/* name of the kernel set selected for this cpu */
+const char* DistanceKernelName();
+
+#endif /* _DISTANCE_H */
@@ -0,0 +1,206 @@
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <boost/program_options.hpp>
+#include "mvptree.hpp"
+
+using namespace std;
+
+namespace po = boost::program_options;
+
+struct Args {
+	int size, queries, clusters, radius, words, candidates, threads, rebuild, knn, leaves;
+	string prefetch, approx;
+	unsigned long long seed;
+	bool grouped, bulk;
+};
+
+Args ParseOptions(int argc, char **argv){
+	Args args;
+	po::options_description descr("Imgscout Benchmark Options");
+
+	try {
+		descr.add_options()
+			("help,h", "produce help message")
+			("size,n", po::value<int>(&args.size)->default_value(200000), "no. hashes in tree")
+			("queries,q", po::value<int>(&args.queries)->default_value(1000), "no. queries")
+			("radius,r", po::value<int>(&args.radius)->default_value(8), "query radius")
+			("words,w", po::value<int>(&args.words)->default_value(1), "no. 64-bit words per hash (1, 2, 4 or 9)")
+			("clusters,c", po::value<int>(&args.clusters)->default_value(1000), "no. clusters of similar hashes")
+			("candidates,v", po::value<int>(&args.candidates)->default_value(MVP_VPCANDIDATES), "no. candidates tried for each vantage point, 0 for arrival order")
+			("prefetch,p", po::value<string>(&args.prefetch)->default_value("0,4"), "comma separated prefetch distances")
+			("grouped,g", po::bool_switch(&args.grouped), "add hashes cluster by cluster rather than in random order")
+			("bulk,b", po::bool_switch(&args.bulk), "add hashes in one batch rather than one at a time")
+			("threads,t", po::value<int>(&args.threads)->default_value(MVP_BUILDTHREADS), "no. threads to build large batches on, 0 for one per core")
+			("knn,k", po::value<int>(&args.knn)->default_value(0), "also time queries for the k nearest hashes, 0 for none")
+			("approx,a", po::value<string>(&args.approx)->default_value(""), "also time approximate queries, for each of comma separated eps")
+			("leaves,l", po::value<int>(&args.leaves)->default_value(0), "most leaves visited by approximate queries, 0 for no limit")
+			("rebuild,e", po::value<int>(&args.rebuild)->default_value(MVP_REBUILDSLICE), "ms. of rebuilding of unbalanced subtrees per batch added, 0 for none")
+			("seed,s", po::value<unsigned long long>(&args.seed)->default_value(1), "random seed");
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(descr).run(), vm);
+		if (vm.count("help")){
+			cout << descr << endl;
+			exit(0);
+		}
+		po::notify(vm);
+	} catch (const po::error &ex){
+		cout << ex.what() << endl;
+		cout << descr << endl;
+		exit(0);
+	}
+	return args;
+}
+
+/* hashes scattered around a cluster center, as near duplicate images are */
+template<int W>
+static HashValue<W> NextHash(mt19937_64 &rng, const HashValue<W> &center){
+	HashValue<W> value = center;
+	int n_bits = rng() % (10*W);
+	for (int i=0;i<n_bits;i++){
+		int bit = rng() % (64*W);
+		value[bit/64] ^= 1ULL << (bit%64);
+	}
+	return value;
+}
+
+template<int W>
+static void RunBench(const Args &args){
+	typedef MVPTree<HammingMetric<W>> ImageTree;
+	typedef typename ImageTree::Point Point;
+
+	mt19937_64 rng(args.seed);
+	vector<HashValue<W>> centers(max(args.clusters, 1));
+	for (HashValue<W> &c : centers){
+		for (unsigned long long &word : c) word = rng();
+	}
+
+	ImageTree::vp_candidates = args.candidates;
+	ImageTree::vp_seed = args.seed;
+	ImageTree::build_threads = args.threads;
+	ImageTree::rebuild_slice = args.rebuild;
+
+	vector<Point> points;
+	for (int i=0;i<args.size;i++){
+		size_t c = args.grouped ? (size_t)i*centers.size()/args.size : rng() % centers.size();
+		points.push_back(Point(i+1, NextHash<W>(rng, centers[c])));
+	}
+
+	ImageTree tree;
+	auto start = chrono::steady_clock::now();
+	if (args.bulk){
+		tree.Add(points);
+	} else {
+		for (Point &dp : points) tree.Add(dp);
+	}
+	tree.Sync();
+	auto end = chrono::steady_clock::now();
+
+	int n_internal, n_leaf;
+	tree.CountNodes(n_internal, n_leaf);
+	cout << "tree: " << tree.Size() << " points, " << n_internal << " internal, "
+		 << n_leaf << " leaf nodes, " << tree.MemoryUsage()/1000000.0 << " MB" << endl;
+	cout << "build: " << chrono::duration<double>(end - start).count() << " s, "
+		 << tree.Rebuilds() << " subtrees rebuilt" << endl;
+
+	vector<Point> targets;
+	for (int i=0;i<args.queries;i++){
+		Point dp(0, NextHash<W>(rng, centers[rng() % centers.size()]));
+		targets.push_back(dp);
+	}
+
+	// warm up, so that the first setting timed does not pay for cold caches
+	for (Point &target : targets) tree.Query(target, args.radius);
+
+	cout << setw(10) << "prefetch" << setw(14) << "us/query" << setw(14) << "ops/query"
+		 << setw(14) << "results" << endl;
+
+	stringstream ss(args.prefetch);
+	string item;
+	while (getline(ss, item, ',')){
+		ImageTree::prefetch_distance = stoi(item);
+
+		long long n_ops = 0, n_results = 0;
+		start = chrono::steady_clock::now();
+		for (Point &target : targets){
+			const list<typename ImageTree::Result> results = tree.Query(target, args.radius);
+			n_ops += ImageTree::n_ops;
+			n_results += results.size();
+		}
+		end = chrono::steady_clock::now();
+
+		double n = max<int>(args.queries, 1);
+		cout << setw(10) << ImageTree::prefetch_distance
+			 << setw(14) << fixed << setprecision(2) << chrono::duration<double, micro>(end - start).count()/n
+			 << setw(14) << n_ops/n << setw(14) << n_results/n << endl;
+	}
+
+	if (args.knn > 0){
+		long long n_ops = 0, n_results = 0;
+		start = chrono::steady_clock::now();
+		for (Point &target : targets){
+			const list<typename ImageTree::Result> results = tree.Nearest(target, args.knn, HammingMetric<W>::MaxDistance);
+			n_ops += ImageTree::n_ops;
+			n_results += results.size();
+		}
+		end = chrono::steady_clock::now();
+
+		double n = max<int>(args.queries, 1);
+		cout << setw(10) << "knn" << setw(14) << fixed << setprecision(2)
+			 << chrono::duration<double, micro>(end - start).count()/n
+			 << setw(14) << n_ops/n << setw(14) << n_results/n << endl;
+	}
+
+	if (!args.approx.empty()){
+		// exact results, to measure the recall of approximate ones against
+		vector<size_t> n_exact;
+		for (Point &target : targets) n_exact.push_back(tree.Query(target, args.radius).size());
+
+		cout << setw(10) << "eps" << setw(14) << "us/query" << setw(14) << "ops/query"
+			 << setw(14) << "recall" << endl;
+
+		stringstream ssapprox(args.approx);
+		while (getline(ssapprox, item, ',')){
+			MVPApprox approx(stod(item), args.leaves);
+
+			long long n_ops = 0, n_found = 0, n_total = 0;
+			start = chrono::steady_clock::now();
+			for (size_t i=0;i<targets.size();i++){
+				const list<typename ImageTree::Result> results = tree.Query(targets[i], args.radius, 0, true,
+																			 NULL, &approx);
+				n_ops += ImageTree::n_ops;
+				n_found += results.size();
+				n_total += n_exact[i];
+			}
+			end = chrono::steady_clock::now();
+
+			double n = max<int>(args.queries, 1);
+			cout << setw(10) << setprecision(2) << approx.eps
+				 << setw(14) << chrono::duration<double, micro>(end - start).count()/n
+				 << setw(14) << n_ops/n << setw(14) << setprecision(4)
+				 << ((n_total > 0) ? (double)n_found/n_total : 1.0) << endl;
+		}
+	}
+
+	tree.Clear();
+}
+
+int main(int argc, char **argv){
+	Args args = ParseOptions(argc, argv);
+
+	switch (args.words){
+#define MVP_BENCH_CASE(W) case W: RunBench<W>(args); break;
+	MVP_FOR_EACH_HASH_WORDS(MVP_BENCH_CASE)
+#undef MVP_BENCH_CASE
+	default:
+		cout << "unsupported no. words: " << args.words << endl;
+		return 1;
+	}
+	return 0;
+}
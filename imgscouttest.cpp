@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <random>
+#include <ctime>
+#include "mvptree.hpp"
+
+using namespace std;
+
+typedef MVPTree<HammingMetric<1>> Tree;
+typedef HashValue<1> Hash;
+typedef DataPoint<1> Point;
+
+#define TEST_SLICE 1          /* ms. of rebuild work asked of each slice */
+#define TEST_MAXSLICES 4      /* multiple of the slice time a slice may run */
+
+/* cpu time of this thread, so time the vm gives other tasks is not counted */
+static double CpuMs(){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+/* Hashes added one at a time, all near one another, pile up under one  */
+/* child of the nodes whose splits were set from the random hashes      */
+/* before them, and are rebuilt a slice at a time while more arrive and */
+/* some are deleted.  Each slice must end close to its time, however    */
+/* large the subtree rebuilt, and the tree must still find every hash.  */
+static bool TestRebuildSlices(const int n_random, const int n_skewed){
+	Tree::rebuild_slice = TEST_SLICE;
+	mt19937_64 rng(1);
+	Tree tree;
+
+	long long id = 1;
+	vector<Point> points;
+	for (int i=0;i<n_random;i++){
+		Hash value;
+		value[0] = rng();
+		points.push_back(Point(id++, value));
+	}
+	tree.Add(points);
+	tree.Sync();
+
+	Hash center;
+	center[0] = rng();
+	double longest = 0;
+	const int rebuilds = tree.Rebuilds();
+	for (int i=0;i<n_skewed;i++){
+		Hash value = center;
+		int n_flips = rng()%12;
+		for (int j=0;j<n_flips;j++) value[0] ^= 1ULL << (rng()%64);
+		tree.Add(Point(id++, value));
+		if (i % 10 == 9) tree.Delete(id - 5);
+
+		if (i % MVP_SYNC == MVP_SYNC/2){
+			double start = CpuMs();
+			tree.Rebalance(TEST_SLICE);
+			longest = max(longest, CpuMs() - start);
+		}
+	}
+	tree.Sync();
+	for (bool pending=true;pending;){
+		double start = CpuMs();
+		pending = tree.Rebalance(TEST_SLICE);
+		longest = max(longest, CpuMs() - start);
+	}
+
+	cout << "rebuild slices: " << tree.Rebuilds() - rebuilds << " rebuilt, longest "
+		 << longest << " ms of " << TEST_SLICE << " ms" << endl;
+	if (tree.Rebuilds() <= rebuilds){
+		cout << "FAIL: no rebuilt subtree was put in place" << endl;
+		return false;
+	}
+	if (longest > TEST_SLICE*TEST_MAXSLICES){
+		cout << "FAIL: slice ran " << longest << " ms" << endl;
+		return false;
+	}
+
+	const map<long long, Hash> &ids = tree.GetMap();
+	for (int q=0;q<20;q++){
+		Hash value = center;
+		value[0] ^= 1ULL << (rng()%64);
+		const int radius = q % 8;
+		long long expected = 0;
+		for (auto iter=ids.begin();iter!=ids.end();iter++){
+			if (__builtin_popcountll(iter->second[0] ^ value[0]) <= radius) expected++;
+		}
+		long long count = tree.Count(Point(0, value), radius);
+		if (count != expected){
+			cout << "FAIL: counted " << count << " of " << expected << " within " << radius << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(){
+	bool passed = TestRebuildSlices(20000, 40000);
+	cout << (passed ? "PASS" : "FAIL") << endl;
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#ifndef _METRIC_H
+#define _METRIC_H
+
+#include <limits>
+#include <type_traits>
+#include "datapoint.hpp"
+#include "distance.hpp"
+
+/* Metric policies for MVPTree.  A policy names the type of its points  */
+/* and distances, and gives the distance between two points, and from a  */
+/* point to a block of hash values.  Distances are non-negative integers */
+/* no greater than MaxDistance.  Split values are held as SplitType,     */
+/* and leaf pivot distances as bytes, divided by PivotScale.  A subtree  */
+/* is summarized in a SummaryType, from which Bound gives a lower bound  */
+/* on the distance from a point to any point in the subtree.             */
+
+/* hamming distance between hashes of W 64-bit words */
+template<int W>
+struct HammingMetric {
+	typedef DataPoint<W> PointType;
+	typedef int DistanceType;
+	typedef typename conditional<(64*W < 255), unsigned char, unsigned short>::type SplitType;
+
+	/* bitwise AND and OR of all hashes in a subtree */
+	struct SummaryType {
+		HashValue<W> andvalue;
+		HashValue<W> orvalue;
+
+		SummaryType(){
+			andvalue.fill(~0ULL);
+			orvalue.fill(0ULL);
+		}
+	};
+
+	static const int Words = W;
+	static const DistanceType MaxDistance = 64*W;
+	static const SplitType NoSplit = numeric_limits<SplitType>::max();
+	static const int PivotScale = MaxDistance/255 + 1;
+
+	static DistanceType Distance(const PointType &a, const PointType &b){
+		DistanceType d = 0;
+		for (int k=0;k<W;k++) d += __builtin_popcountll(a.value[k]^b.value[k]);
+		return d;
+	}
+
+	static void Distances(const PointType &target, const unsigned long long *values, const int n,
+						  DistanceType *dists){
+		HammingDistances(target.value.data(), values, W, n, dists);
+	}
+
+	static void Summarize(SummaryType &summary, const PointType &p){
+		for (int k=0;k<W;k++){
+			summary.andvalue[k] &= p.value[k];
+			summary.orvalue[k] |= p.value[k];
+		}
+	}
+
+	/* bits set in every hash of the subtree but not in target, and bits */
+	/* clear in every hash but set in target, differ for all its points  */
+	static DistanceType Bound(const PointType &target, const SummaryType &summary){
+		DistanceType d = 0;
+		for (int k=0;k<W;k++){
+			d += __builtin_popcountll(summary.andvalue[k] & ~target.value[k]);
+			d += __builtin_popcountll(~summary.orvalue[k] & target.value[k]);
+		}
+		return d;
+	}
+};
+
+#endif /* _METRIC_H */
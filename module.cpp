@@ -1,12 +1,17 @@
 #include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <strings.h>
+#include <type_traits>
 #include <string>
 #include <ctime>
 #include <chrono>
 #include <list>
 #include "redismodule.h"
 #include "mvptree.hpp"
+#include "distance.hpp"
 
-#define MVPTREE_ENCODING_VERSION 0
+#define MVPTREE_ENCODING_VERSION 1
 
 using namespace std;
 
@@ -14,6 +19,54 @@ static RedisModuleType *MVPTreeType;
 
 static const char *descr_field = "descr";
 
+/* =================== module arguments ============================*/
+
+/* parse name/value pairs given to loadmodule:
+   PREFETCH n   - no. nodes ahead of a query's traversal to prefetch
+   CANDIDATES n - no. candidates tried for each vantage point, 0 for arrival order
+   SEED n       - seed of the vantage point candidate draws
+   THREADS n    - no. threads large batches are built on, 0 for one per core
+   REBUILD ms   - ms. of rebuilding of unbalanced subtrees per batch added, 0 for none */
+static int ParseModuleArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc % 2 != 0){
+		RedisModule_Log(ctx, "warning", "module arguments must be name value pairs");
+		return REDISMODULE_ERR;
+	}
+	for (int i=0;i<argc;i+=2){
+		const char *name = RedisModule_StringPtrLen(argv[i], NULL);
+		long long value;
+		if (RedisModule_StringToLongLong(argv[i+1], &value) == REDISMODULE_ERR || value < 0){
+			RedisModule_Log(ctx, "warning", "bad value for module argument %s", name);
+			return REDISMODULE_ERR;
+		}
+		if (!strcasecmp(name, "prefetch")){
+#define MVP_SET_PREFETCH(W) MVPTree<HammingMetric<W>>::prefetch_distance = value;
+			MVP_FOR_EACH_HASH_WORDS(MVP_SET_PREFETCH)
+#undef MVP_SET_PREFETCH
+		} else if (!strcasecmp(name, "candidates")){
+#define MVP_SET_CANDIDATES(W) MVPTree<HammingMetric<W>>::vp_candidates = value;
+			MVP_FOR_EACH_HASH_WORDS(MVP_SET_CANDIDATES)
+#undef MVP_SET_CANDIDATES
+		} else if (!strcasecmp(name, "seed")){
+#define MVP_SET_SEED(W) MVPTree<HammingMetric<W>>::vp_seed = value;
+			MVP_FOR_EACH_HASH_WORDS(MVP_SET_SEED)
+#undef MVP_SET_SEED
+		} else if (!strcasecmp(name, "threads")){
+#define MVP_SET_THREADS(W) MVPTree<HammingMetric<W>>::build_threads = value;
+			MVP_FOR_EACH_HASH_WORDS(MVP_SET_THREADS)
+#undef MVP_SET_THREADS
+		} else if (!strcasecmp(name, "rebuild")){
+#define MVP_SET_REBUILD(W) MVPTree<HammingMetric<W>>::rebuild_slice = value;
+			MVP_FOR_EACH_HASH_WORDS(MVP_SET_REBUILD)
+#undef MVP_SET_REBUILD
+		} else {
+			RedisModule_Log(ctx, "warning", "unknown module argument %s", name);
+			return REDISMODULE_ERR;
+		}
+	}
+	return REDISMODULE_OK;
+}
+
 /* =================== dyn mem management ==========================*/
 void* operator new(size_t sz){
 	void *ptr = RedisModule_Alloc(sz);
@@ -125,13 +178,198 @@ void DeleteKey(RedisModuleCtx *ctx, RedisModuleString *keystr){
 	return;
 }
 
-unsigned long long RMStringToUnsignedLongLong(const RedisModuleString *str){
-	return strtoull(RedisModule_StringPtrLen(str, NULL), NULL, 10);
+static bool IsHexDigit(const char c){
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static int HexDigitValue(const char c){
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return c - 'A' + 10;
+}
+
+static bool IsHashWords(const int words){
+	switch (words){
+#define MVP_HASH_WORDS_CASE(W) case W:
+	MVP_FOR_EACH_HASH_WORDS(MVP_HASH_WORDS_CASE)
+#undef MVP_HASH_WORDS_CASE
+		return true;
+	}
+	return false;
+}
+
+static bool IsDecimalArg(const char *ptr, const size_t len){
+	size_t start = (len > 0 && ptr[0] == '-') ? 1 : 0;
+	if (len <= start || len - start > 20) return false;
+	for (size_t i=start;i<len;i++){
+		if (ptr[i] < '0' || ptr[i] > '9') return false;
+	}
+	return true;
+}
+
+static bool IsRawArg(const char *ptr, const size_t len){
+	return len > 2 && ptr[0] == '0' && (ptr[1] == 'r' || ptr[1] == 'R');
+}
+
+static bool IsHexArg(const char *ptr, const size_t len){
+	if (len <= 2 || ptr[0] != '0' || (ptr[1] != 'x' && ptr[1] != 'X')) return false;
+	for (size_t i=2;i<len;i++){
+		if (!IsHexDigit(ptr[i])) return false;
+	}
+	return true;
+}
+
+/* Hash arguments are given in one of three formats:
+     decimal - 64-bit hashes only, as the unsigned integer (a sign is allowed)
+     hex     - 0x followed by 16 hex digits per 64-bit word, high order first;
+               64-bit hashes may have fewer digits
+     binary  - 0r followed by the raw bytes of the hash, 8 per 64-bit word, high
+               order first
+   Each format has its own prefix, or none for decimal, so that raw bytes that
+   happen to be digits are not read as a number.
+   Returns the no. 64-bit words of the hash, 0 if it is in none of the formats. */
+static int HashArgWords(const RedisModuleString *str){
+	size_t len;
+	const char *ptr = RedisModule_StringPtrLen(str, &len);
+
+	if (IsDecimalArg(ptr, len)) return 1;
+
+	if (IsHexArg(ptr, len)){
+		int words = (len - 2 + 15)/16;
+		if (words == 1 || (IsHashWords(words) && len - 2 == (size_t)words*16)) return words;
+	}
+
+	if (IsRawArg(ptr, len) && (len - 2) % 8 == 0 && IsHashWords((len - 2)/8)) return (len - 2)/8;
+	return 0;
+}
+
+/* parse a hash argument of the given no. 64-bit words into value */
+static int ParseHashArg(const RedisModuleString *str, const int words, unsigned long long *value){
+	if (HashArgWords(str) != words) return REDISMODULE_ERR;
+
+	size_t len;
+	const char *ptr = RedisModule_StringPtrLen(str, &len);
+	for (int k=0;k<words;k++) value[k] = 0;
+
+	if (IsDecimalArg(ptr, len)){
+		value[0] = strtoull(ptr, NULL, 10);
+	} else if (IsHexArg(ptr, len)){
+		// right aligned, so that short hex values read as numbers
+		int n_digits = len - 2;
+		for (int i=0;i<n_digits;i++){
+			int pos = words*16 - n_digits + i;
+			value[pos/16] |= (unsigned long long)HexDigitValue(ptr[2+i]) << (4*(15 - pos%16));
+		}
+	} else {
+		for (size_t i=0;i<len-2;i++){
+			value[i/8] |= (unsigned long long)(unsigned char)ptr[2+i] << (8*(7 - i%8));
+		}
+	}
+	return REDISMODULE_OK;
+}
+
+/* radius as a whole no. of bits, distances being integers within radius */
+/* iff within its floor, at most the width of hashes of words 64-bit     */
+/* words, and -1 if negative                                             */
+static int ClampRadius(const double radius, const int words){
+	const int max_distance = 64*words;
+	return (radius < 0) ? -1 : (radius > max_distance) ? max_distance : (int)floor(radius);
+}
+
+/* hash in a format ParseHashArg reads back: decimal for 64-bit hashes, hex otherwise */
+static string FormatHash(const unsigned long long *value, const int words){
+	if (words == 1) return to_string(value[0]);
+
+	static const char *digits = "0123456789abcdef";
+	string str = "0x";
+	for (int k=0;k<words;k++){
+		for (int i=15;i>=0;i--) str += digits[(value[k] >> (4*i)) & 0x0f];
+	}
+	return str;
+}
+
+/* scan cursor: the node serial when it was left, then the path of child indices to resume */
+/* from, separated by dots.  "0" starts a scan and is returned at its end.   */
+static string FormatCursor(const uint32_t since, const vector<int> &path){
+	if (path.empty()) return "0";
+
+	string str = to_string(since);
+	for (int index : path) str += "." + to_string(index);
+	return str;
+}
+
+static int ParseCursorArg(const RedisModuleString *str, uint32_t &since, vector<int> &path){
+	size_t len;
+	const char *ptr = RedisModule_StringPtrLen(str, &len);
+	since = 0;
+	path.clear();
+	if (len == 1 && ptr[0] == '0') return REDISMODULE_OK;
+
+	// dot separated decimal fields, the serial first
+	size_t i = 0;
+	while (i < len){
+		size_t start = i;
+		while (i < len && ptr[i] >= '0' && ptr[i] <= '9') i++;
+		if (i == start || i - start > 18 || (i < len && ptr[i] != '.')) return REDISMODULE_ERR;
+		unsigned long long field = strtoull(string(ptr + start, i - start).c_str(), NULL, 10);
+		if (start == 0){
+			if (field > UINT32_MAX) return REDISMODULE_ERR;
+			since = (uint32_t)field;
+		} else {
+			if (field > INT_MAX) return REDISMODULE_ERR;
+			path.push_back((int)field);
+		}
+		if (i < len && ++i == len) return REDISMODULE_ERR;
+	}
+	return (path.empty()) ? REDISMODULE_ERR : REDISMODULE_OK;
 }
 
 /* ============== Get MVPTree =======================================*/
 
-MVPTree* GetMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr){
+template<int W>
+using ImageTree = MVPTree<HammingMetric<W>>;
+
+/* value of an MVPTreeDS key: a tree for hashes of the no. 64-bit words
+   set when the key was created */
+struct ImageIndex {
+	int words;
+	void *tree;
+};
+
+/* call f with the index's tree, typed for its hash width */
+template<class F>
+static auto VisitTree(const ImageIndex *index, F f){
+	switch (index->words){
+#define MVP_VISIT_CASE(W) case W: return f((ImageTree<W>*)index->tree);
+	MVP_FOR_EACH_HASH_WORDS(MVP_VISIT_CASE)
+#undef MVP_VISIT_CASE
+	}
+	throw invalid_argument("unsupported hash width");
+}
+
+static ImageIndex* NewImageIndex(const int words){
+	ImageIndex *index = new ImageIndex;
+	index->words = words;
+	switch (words){
+#define MVP_NEW_CASE(W) case W: index->tree = new ImageTree<W>(); break;
+	MVP_FOR_EACH_HASH_WORDS(MVP_NEW_CASE)
+#undef MVP_NEW_CASE
+	default:
+		delete index;
+		throw invalid_argument("unsupported hash width");
+	}
+	return index;
+}
+
+static void DeleteImageIndex(ImageIndex *index){
+	VisitTree(index, [](auto *tree){
+		tree->Clear();
+		delete tree;
+	});
+	delete index;
+}
+
+ImageIndex* GetMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr){
 	RedisModuleKey *key = (RedisModuleKey*)RedisModule_OpenKey(ctx, keystr, REDISMODULE_READ);
 	int keytype = RedisModule_KeyType(key);
 	if (keytype == REDISMODULE_KEYTYPE_EMPTY){
@@ -144,14 +382,15 @@ MVPTree* GetMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr){
 		throw -1;
 	}
 
-	MVPTree *tree = (MVPTree*)RedisModule_ModuleTypeGetValue(key);
+	ImageIndex *index = (ImageIndex*)RedisModule_ModuleTypeGetValue(key);
 
 	RedisModule_CloseKey(key);
-	return tree;
+	return index;
 }
 
-/* Create a new data type, throw -1 exception if already exists for a different type */
-MVPTree* CreateMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr){
+/* Create a new data type for hashes of the given no. 64-bit words,
+   throw -1 exception if already exists for a different type */
+ImageIndex* CreateMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr, const int words){
 	RedisModuleKey *key = (RedisModuleKey*)RedisModule_OpenKey(ctx, keystr, REDISMODULE_WRITE);
 	int keytype = RedisModule_KeyType(key);
 	if (keytype != REDISMODULE_KEYTYPE_EMPTY && RedisModule_ModuleTypeGetType(key) != MVPTreeType){
@@ -159,64 +398,82 @@ MVPTree* CreateMVPTree(RedisModuleCtx *ctx, RedisModuleString *keystr){
 		throw -1;
 	}
 
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	if (keytype == REDISMODULE_KEYTYPE_EMPTY){
-		tree = (MVPTree*)new MVPTree();
-		RedisModule_ModuleTypeSetValue(key, MVPTreeType, tree);
+		index = NewImageIndex(words);
+		RedisModule_ModuleTypeSetValue(key, MVPTreeType, index);
 	} else {
-		tree = (MVPTree*)RedisModule_ModuleTypeGetValue(key);
+		index = (ImageIndex*)RedisModule_ModuleTypeGetValue(key);
 	}
 
 	RedisModule_CloseKey(key);
-	return tree;
+	return index;
 }
 
 /* ============== MVPTree type methods ==============================*/
+
+/* encoding 0: n_points, then id and 64-bit hash for each point
+   encoding 1: no. 64-bit words of each hash, n_points, then id and hash words for each point */
 extern "C" void* MVPTreeTypeRdbLoad(RedisModuleIO *rdb, int encver){
-	if (encver != MVPTREE_ENCODING_VERSION){
+	if (encver > MVPTREE_ENCODING_VERSION){
 		RedisModule_LogIOError(rdb, "warning", "rdbload unable to encode for encver %d", encver);
 		return NULL;
 	}
 
-	MVPTree *tree = (MVPTree*)new MVPTree();
-
-	unsigned long long n_points = RedisModule_LoadUnsigned(rdb);
-	for (unsigned long long i=0;i<n_points;i++){
-		DataPoint *dp = new DataPoint();
-		dp->id = RedisModule_LoadSigned(rdb);
-		dp->value = RedisModule_LoadUnsigned(rdb);
-		tree->Add(dp);
+	int words = (encver == 0) ? 1 : RedisModule_LoadUnsigned(rdb);
+	if (!IsHashWords(words)){
+		RedisModule_LogIOError(rdb, "warning", "rdbload unsupported hash width of %d words", words);
+		return NULL;
 	}
-	
-	tree->Sync();
-	return (void*)tree;
+
+	ImageIndex *index = NewImageIndex(words);
+	VisitTree(index, [&](auto *tree){
+		typename remove_pointer<decltype(tree)>::type::Point dp;
+		unsigned long long n_points = RedisModule_LoadUnsigned(rdb);
+		vector<decltype(dp)> points;
+		points.reserve(n_points);
+		for (unsigned long long i=0;i<n_points;i++){
+			dp.id = RedisModule_LoadSigned(rdb);
+			for (int k=0;k<words;k++) dp.value[k] = RedisModule_LoadUnsigned(rdb);
+			points.push_back(dp);
+		}
+		// built as one batch, in parallel
+		tree->Add(points);
+		tree->Sync();
+	});
+	return (void*)index;
 }
 extern "C" void MVPTreeTypeRdbSave(RedisModuleIO *rdb, void *value){
-	MVPTree *tree = (MVPTree*)value;
-
-	const map<long long, DataPoint*> ids = tree->GetMap();
-	RedisModule_SaveUnsigned(rdb, ids.size());
-	for (auto iter=ids.begin();iter!=ids.end();iter++){
-		RedisModule_SaveSigned(rdb, iter->second->id);
-		RedisModule_SaveUnsigned(rdb, iter->second->value);
-	}
+	ImageIndex *index = (ImageIndex*)value;
+
+	RedisModule_SaveUnsigned(rdb, index->words);
+	VisitTree(index, [&](auto *tree){
+		const auto &ids = tree->GetMap();
+		RedisModule_SaveUnsigned(rdb, ids.size());
+		for (auto iter=ids.begin();iter!=ids.end();iter++){
+			RedisModule_SaveSigned(rdb, iter->first);
+			for (unsigned long long word : iter->second) RedisModule_SaveUnsigned(rdb, word);
+		}
+	});
 }
 extern "C" void MVPTreeTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value){
-	MVPTree *tree = (MVPTree*)value;
+	ImageIndex *index = (ImageIndex*)value;
 	
-	const map<long long, DataPoint*> ids = tree->GetMap();
-	for (auto iter=ids.begin();iter!=ids.end();iter++){
-		RedisModule_EmitAOF(aof, "imgscout.addrepl", "sll", key, iter->second->value, iter->first);
-	}
+	VisitTree(index, [&](auto *tree){
+		const auto &ids = tree->GetMap();
+		for (auto iter=ids.begin();iter!=ids.end();iter++){
+			string hash = FormatHash(iter->second.data(), index->words);
+			RedisModule_EmitAOF(aof, "imgscout.addrepl", "scl", key, hash.c_str(), iter->first);
+		}
+	});
 }
 extern "C" void MVPTreeTypeFree(void *value){
-	MVPTree *tree = (MVPTree*)value;
-	tree->Clear();
+	DeleteImageIndex((ImageIndex*)value);
 }
 
 extern "C" size_t MVPTreeTypeMemUsage(const void *value){
-	MVPTree *tree = (MVPTree*)value;
-	size_t n_bytes = tree->MemoryUsage();
+	const ImageIndex *index = (const ImageIndex*)value;
+	size_t n_bytes = sizeof(ImageIndex) + VisitTree(index, [](auto *tree){ return tree->MemoryUsage(); });
 	return n_bytes;
 	
 }
@@ -233,10 +490,17 @@ extern "C" int MVPTreeAddRepl_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **
 
 	RedisModule_AutoMemory(ctx);
 
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL) tree = CreateMVPTree(ctx, argv[1]);
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			int words = HashArgWords(argv[2]);
+			if (words == 0){
+				RedisModule_ReplyWithError(ctx, "ERR - unable to parse hash value");
+				return REDISMODULE_ERR;
+			}
+			index = CreateMVPTree(ctx, argv[1], words);
+		}
 	} catch (int &e){
 		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
 		return REDISMODULE_ERR;
@@ -248,12 +512,16 @@ extern "C" int MVPTreeAddRepl_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **
 		return REDISMODULE_ERR;
 	}
 
-	unsigned long long hashvalue = RMStringToUnsignedLongLong(argv[2]);
-	DataPoint *dp = new DataPoint();
-	dp->id = id;
-	dp->value = hashvalue;
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
 
-	tree->Add(dp);
+	VisitTree(index, [&](auto *tree){
+		typename remove_pointer<decltype(tree)>::type::Point dp(id, hash_value);
+		tree->Add(dp);
+	});
 
 	RedisModule_ReplyWithLongLong(ctx, id);
 	return REDISMODULE_OK;
@@ -265,10 +533,17 @@ extern "C" int MVPTreeAdd_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv
 
 	RedisModule_AutoMemory(ctx);
 
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL) tree = CreateMVPTree(ctx, argv[1]);
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			int words = HashArgWords(argv[2]);
+			if (words == 0){
+				RedisModule_ReplyWithError(ctx, "ERR - unable to parse hash value");
+				return REDISMODULE_ERR;
+			}
+			index = CreateMVPTree(ctx, argv[1], words);
+		}
 	} catch (int &e){
 		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
 		return REDISMODULE_ERR;
@@ -287,13 +562,17 @@ extern "C" int MVPTreeAdd_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv
 		}
 	}
 
-	unsigned long long hash_value = RMStringToUnsignedLongLong(argv[2]);
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
 
-	DataPoint *dp = new DataPoint();
-	dp->id = id;
-	dp->value = hash_value;
 	try {
-		tree->Add(dp);
+		VisitTree(index, [&](auto *tree){
+			typename remove_pointer<decltype(tree)>::type::Point dp(id, hash_value);
+			tree->Add(dp);
+		});
 	} catch (exception &ex){
 		RedisModule_ReplyWithError(ctx, "ERR - unable to add element");
 		return REDISMODULE_ERR;
@@ -319,10 +598,10 @@ extern "C" int MVPTreeSync_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **arg
 
 	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
 	
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL){
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
 			RedisModule_ReplyWithError(ctx, "ERR - no such key");
 			return REDISMODULE_ERR;
 		}
@@ -332,13 +611,13 @@ extern "C" int MVPTreeSync_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **arg
 	}
 
 	try {
-		tree->Sync();
+		VisitTree(index, [](auto *tree){ tree->Sync(); });
 	} catch (exception &ex){
 		RedisModule_ReplyWithError(ctx, "ERR - unable to sync");
 		return REDISMODULE_ERR;
 	}
   
-	int n_points = tree->Size();
+	int n_points = VisitTree(index, [](auto *tree){ return tree->Size(); });
 
 	RedisModule_ReplyWithSimpleString(ctx, "OK");
 	RedisModule_ReplicateVerbatim(ctx);
@@ -350,18 +629,345 @@ extern "C" int MVPTreeSync_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **arg
 	return REDISMODULE_OK;
 }
 
-/* args: key hashtarget radius */
+/* reply with an array of title, id and distance for each result */
+template<typename R>
+static void ReplyWithResults(RedisModuleCtx *ctx, RedisModuleString *keystr, const list<R> &results){
+	RedisModule_ReplyWithArray(ctx, results.size());
+	for (const R &r : results){
+		RedisModuleString *reply_descr = GetDescriptionField(ctx, keystr, r.id);
+		RedisModule_ReplyWithArray(ctx, 3);
+		RedisModule_ReplyWithString(ctx, reply_descr);
+		RedisModule_ReplyWithLongLong(ctx, r.id);
+		RedisModule_ReplyWithDouble(ctx, r.distance);
+	}
+}
+
+/* args: key hashtarget radius [LIMIT n [SORTED|ANY]] [BUDGET n MS|OPS] [APPROX eps [LEAVES n]] */
 extern "C" int MVPTreeQuery_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc < 4) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
+
+	double radius;
+	if (RedisModule_StringToDouble(argv[3], &radius) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
+		return REDISMODULE_ERR;
+	}
+
+	int iradius = ClampRadius(radius, index->words);
+
+	long long limit = 0;
+	bool sorted = true;
+	long long max_ops = 0;
+	double max_ms = 0;
+	bool budgeted = false;
+	double eps = 0;
+	long long max_leaves = 0;
+	bool approximate = false;
+	for (int i=4;i<argc; ){
+		const char *option = RedisModule_StringPtrLen(argv[i], NULL);
+		if (!strcasecmp(option, "limit")){
+			if (i + 1 >= argc || RedisModule_StringToLongLong(argv[i+1], &limit) == REDISMODULE_ERR
+				|| limit < 1 || limit > INT_MAX){
+				RedisModule_ReplyWithError(ctx, "ERR - expected LIMIT n, n a positive integer");
+				return REDISMODULE_ERR;
+			}
+			i += 2;
+			if (i < argc){
+				const char *mode = RedisModule_StringPtrLen(argv[i], NULL);
+				if (!strcasecmp(mode, "any")){
+					sorted = false;
+					i++;
+				} else if (!strcasecmp(mode, "sorted")){
+					i++;
+				}
+			}
+		} else if (!strcasecmp(option, "budget")){
+			double amount;
+			if (i + 2 >= argc || RedisModule_StringToDouble(argv[i+1], &amount) == REDISMODULE_ERR || amount <= 0){
+				RedisModule_ReplyWithError(ctx, "ERR - expected BUDGET n MS|OPS, n a positive number");
+				return REDISMODULE_ERR;
+			}
+			const char *unit = RedisModule_StringPtrLen(argv[i+2], NULL);
+			if (!strcasecmp(unit, "ms")){
+				max_ms = amount;
+			} else if (!strcasecmp(unit, "ops")){
+				max_ops = (long long)ceil(amount);
+			} else {
+				RedisModule_ReplyWithError(ctx, "ERR - expected BUDGET n MS|OPS, n a positive number");
+				return REDISMODULE_ERR;
+			}
+			budgeted = true;
+			i += 3;
+		} else if (!strcasecmp(option, "approx")){
+			if (i + 1 >= argc || RedisModule_StringToDouble(argv[i+1], &eps) == REDISMODULE_ERR || eps < 0){
+				RedisModule_ReplyWithError(ctx, "ERR - expected APPROX eps, eps a non-negative number");
+				return REDISMODULE_ERR;
+			}
+			i += 2;
+			if (i < argc && !strcasecmp(RedisModule_StringPtrLen(argv[i], NULL), "leaves")){
+				if (i + 1 >= argc || RedisModule_StringToLongLong(argv[i+1], &max_leaves) == REDISMODULE_ERR
+					|| max_leaves < 1 || max_leaves > INT_MAX){
+					RedisModule_ReplyWithError(ctx, "ERR - expected LEAVES n, n a positive integer");
+					return REDISMODULE_ERR;
+				}
+				i += 2;
+			}
+			approximate = true;
+		} else {
+			RedisModule_ReplyWithError(ctx, "ERR - expected LIMIT, BUDGET or APPROX");
+			return REDISMODULE_ERR;
+		}
+	}
+	MVPBudget budget(max_ops, max_ms);
+	MVPApprox approx(eps, (int)max_leaves);
+
+	double pct_opers;
+	try {
+		pct_opers = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target(0, hash_value);
+			list<typename Tree::Result> results = tree->Query(target, iradius, (int)limit, sorted,
+															   budgeted ? &budget : NULL,
+															   approximate ? &approx : NULL);
+			if (budgeted){
+				RedisModule_ReplyWithArray(ctx, 2);
+				RedisModule_ReplyWithLongLong(ctx, budget.Completed() ? 1 : 0);
+			}
+			ReplyWithResults(ctx, argv[1], results);
+
+			// calculate pct of distance operations
+			return (double)tree->n_ops/(double)tree->Size();
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "query in %llu microseconds (%f ops)", elapsed, pct_opers);
+	
+	return REDISMODULE_OK;
+}
+
+/* args: key radius hashtarget [hashtarget ...] */
+extern "C" int MVPTreeMultiQuery_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc < 4) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	double radius;
+	if (RedisModule_StringToDouble(argv[2], &radius) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
+		return REDISMODULE_ERR;
+	}
+
+	int iradius = ClampRadius(radius, index->words);
+
+	int n_targets = argc - 3;
+	vector<unsigned long long> hash_values(n_targets*index->words);
+	for (int i=0;i<n_targets;i++){
+		if (ParseHashArg(argv[3+i], index->words, hash_values.data() + i*index->words) == REDISMODULE_ERR){
+			RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+			return REDISMODULE_ERR;
+		}
+	}
+
+	double pct_opers;
+	try {
+		pct_opers = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			vector<typename Tree::Point> targets;
+			for (int i=0;i<n_targets;i++) targets.emplace_back(0, hash_values.data() + i*index->words);
+			vector<list<typename Tree::Result>> results = tree->Query(targets, iradius);
+
+			RedisModule_ReplyWithArray(ctx, results.size());
+			for (list<typename Tree::Result> &targetresults : results) ReplyWithResults(ctx, argv[1], targetresults);
+			return (double)tree->n_ops/(double)tree->Size();
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "query of %d targets in %llu microseconds (%f ops)", n_targets, elapsed, pct_opers);
+	
+	return REDISMODULE_OK;
+}
+
+/* args: key hashtarget k [maxradius] */
+extern "C" int MVPTreeKnn_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc != 4 && argc != 5) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
+
+	long long k;
+	if (RedisModule_StringToLongLong(argv[3], &k) == REDISMODULE_ERR || k < 1 || k > INT_MAX){
+		RedisModule_ReplyWithError(ctx, "ERR - k must be a positive integer");
+		return REDISMODULE_ERR;
+	}
+
+	double radius = 64*index->words;
+	if (argc == 5 && RedisModule_StringToDouble(argv[4], &radius) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
+		return REDISMODULE_ERR;
+	}
+	int iradius = ClampRadius(radius, index->words);
+
+	double pct_opers;
+	try {
+		pct_opers = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target(0, hash_value);
+			list<typename Tree::Result> results = tree->Nearest(target, (int)k, iradius);
+			ReplyWithResults(ctx, argv[1], results);
+			return (double)tree->n_ops/(double)tree->Size();
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "knn query in %llu microseconds (%f ops)", elapsed, pct_opers);
+	
+	return REDISMODULE_OK;
+}
+
+/* args: key hashtarget radius [CAP n] */
+extern "C" int MVPTreeCount_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc != 4 && argc != 6) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
+
+	double radius;
+	if (RedisModule_StringToDouble(argv[3], &radius) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
+		return REDISMODULE_ERR;
+	}
+
+	int iradius = ClampRadius(radius, index->words);
+
+	long long cap = 0;
+	if (argc > 4){
+		if (strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "cap")
+			|| RedisModule_StringToLongLong(argv[5], &cap) == REDISMODULE_ERR || cap < 1){
+			RedisModule_ReplyWithError(ctx, "ERR - expected CAP n, n a positive integer");
+			return REDISMODULE_ERR;
+		}
+	}
+
+	long long count;
+	try {
+		count = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target(0, hash_value);
+			return tree->Count(target, iradius, cap);
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	RedisModule_ReplyWithLongLong(ctx, count);
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "count of %lld in %llu microseconds", count, elapsed);
+	
+	return REDISMODULE_OK;
+}
+
+/* args: key hashtarget maxradius */
+extern "C" int MVPTreeHistogram_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
 	if (argc != 4) return RedisModule_WrongArity(ctx);
 
 	RedisModule_AutoMemory(ctx);
 
 	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
 	
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL){
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
 			RedisModule_ReplyWithError(ctx, "ERR - no such key");
 			return REDISMODULE_ERR;
 		}
@@ -370,39 +976,191 @@ extern "C" int MVPTreeQuery_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **ar
 		return REDISMODULE_ERR;
 	}
 
-	unsigned long long hash_value = RMStringToUnsignedLongLong(argv[2]);
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
+
+	double radius;
+	if (RedisModule_StringToDouble(argv[3], &radius) == REDISMODULE_ERR || radius < 0){
+		RedisModule_ReplyWithError(ctx, "ERR - maxradius must be a non-negative number");
+		return REDISMODULE_ERR;
+	}
+
+	int iradius = ClampRadius(radius, index->words);
+
+	double pct_opers;
+	try {
+		pct_opers = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target(0, hash_value);
+			vector<long long> counts = tree->Histogram(target, iradius);
+
+			RedisModule_ReplyWithArray(ctx, counts.size());
+			for (long long n : counts) RedisModule_ReplyWithLongLong(ctx, n);
+			return (double)tree->n_ops/(double)tree->Size();
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "histogram in %llu microseconds (%f ops)", elapsed, pct_opers);
+	
+	return REDISMODULE_OK;
+}
+
+/* args: key hashtarget radius COUNT n [CURSOR c] */
+extern "C" int MVPTreeScan_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc != 6 && argc != 8) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	unsigned long long hash_value[MVP_MAXHASHWORDS];
+	if (ParseHashArg(argv[2], index->words, hash_value) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - hash value does not match width of key");
+		return REDISMODULE_ERR;
+	}
+
 	double radius;
 	if (RedisModule_StringToDouble(argv[3], &radius) == REDISMODULE_ERR){
 		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
 		return REDISMODULE_ERR;
 	}
 
-	DataPoint target;
-	target.value = hash_value;
+	int iradius = ClampRadius(radius, index->words);
+
+	long long count;
+	if (strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "count")
+		|| RedisModule_StringToLongLong(argv[5], &count) == REDISMODULE_ERR || count < 1 || count > INT_MAX){
+		RedisModule_ReplyWithError(ctx, "ERR - expected COUNT n, n a positive integer");
+		return REDISMODULE_ERR;
+	}
+
+	uint32_t since = 0;
+	vector<int> cursor;
+	if (argc > 6 && (strcasecmp(RedisModule_StringPtrLen(argv[6], NULL), "cursor")
+					 || ParseCursorArg(argv[7], since, cursor) == REDISMODULE_ERR)){
+		RedisModule_ReplyWithError(ctx, "ERR - expected CURSOR c, c a cursor returned by imgscout.qscan");
+		return REDISMODULE_ERR;
+	}
 
-	list<QueryResult> results;
+	size_t n_results;
 	try {
-		results = tree->Query(target, radius);
+		n_results = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target(0, hash_value);
+			list<typename Tree::Result> results = tree->Scan(target, iradius, (int)count, cursor, since);
+
+			RedisModule_ReplyWithArray(ctx, 2);
+			string next = FormatCursor(since, cursor);
+			RedisModule_ReplyWithStringBuffer(ctx, next.c_str(), next.size());
+			ReplyWithResults(ctx, argv[1], results);
+			return results.size();
+		});
+	} catch (invalid_argument &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - invalid cursor");
+		return REDISMODULE_ERR;
 	} catch (exception &ex){
 		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
 		return REDISMODULE_ERR;
 	}
+
+	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
+	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
+	RedisModule_Log(ctx, "debug", "scan of %zu results in %llu microseconds", n_results, elapsed);
 	
-	RedisModule_ReplyWithArray(ctx, results.size());
-	for (QueryResult &r: results){
-		RedisModuleString *reply_descr = GetDescriptionField(ctx, argv[1], r.dp->id);
-		RedisModule_ReplyWithArray(ctx, 3);
-		RedisModule_ReplyWithString(ctx, reply_descr);
-		RedisModule_ReplyWithLongLong(ctx, r.dp->id);
-		RedisModule_ReplyWithDouble(ctx, r.distance);
+	return REDISMODULE_OK;
+}
+
+/* args: key id radius [LIMIT n] */
+extern "C" int MVPTreeQueryById_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+	if (argc != 4 && argc != 6) return RedisModule_WrongArity(ctx);
+
+	RedisModule_AutoMemory(ctx);
+
+	chrono::time_point<chrono::high_resolution_clock> start = chrono::high_resolution_clock::now();
+	
+	ImageIndex *index = NULL;
+	try {
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
+			RedisModule_ReplyWithError(ctx, "ERR - no such key");
+			return REDISMODULE_ERR;
+		}
+	} catch (int &e){
+		RedisModule_ReplyWithError(ctx, "ERR - key exists for different type.  Delete first.");
+		return REDISMODULE_ERR;
+	}
+
+	long long id;
+	if (RedisModule_StringToLongLong(argv[2], &id) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to parse id");
+		return REDISMODULE_ERR;
+	}
+
+	double radius;
+	if (RedisModule_StringToDouble(argv[3], &radius) == REDISMODULE_ERR){
+		RedisModule_ReplyWithError(ctx, "unable to parse radius value");
+		return REDISMODULE_ERR;
 	}
 
-	// calculate pct of distance operations
-	double pct_opers = (double)MVPTree::n_ops/(double)tree->Size();
+	int iradius = ClampRadius(radius, index->words);
+
+	long long limit = 0;
+	if (argc > 4){
+		if (strcasecmp(RedisModule_StringPtrLen(argv[4], NULL), "limit")
+			|| RedisModule_StringToLongLong(argv[5], &limit) == REDISMODULE_ERR || limit < 1 || limit >= INT_MAX){
+			RedisModule_ReplyWithError(ctx, "ERR - expected LIMIT n, n a positive integer");
+			return REDISMODULE_ERR;
+		}
+	}
+
+	bool found;
+	try {
+		found = VisitTree(index, [&](auto *tree){
+			typedef typename remove_pointer<decltype(tree)>::type Tree;
+			typename Tree::Point target;
+			if (!tree->Lookup(id, target)) return false;
+
+			// one more, as the item itself is among the nearest
+			list<typename Tree::Result> results = tree->Query(target, iradius, (limit > 0) ? (int)limit + 1 : 0);
+			results.remove_if([&](const typename Tree::Result &r){ return r.id == id; });
+			if (limit > 0 && (long long)results.size() > limit) results.pop_back();
+
+			ReplyWithResults(ctx, argv[1], results);
+			return true;
+		});
+	} catch (exception &ex){
+		RedisModule_ReplyWithError(ctx, "ERR - unable to complete query");
+		return REDISMODULE_ERR;
+	}
+
+	if (!found){
+		RedisModule_ReplyWithError(ctx, "ERR - no such id in index");
+		return REDISMODULE_ERR;
+	}
 
 	chrono::time_point<chrono::high_resolution_clock> end = chrono::high_resolution_clock::now();
 	auto elapsed = chrono::duration_cast<chrono::microseconds>(end - start).count();
-	RedisModule_Log(ctx, "debug", "query in %llu microseconds (%f ops)", elapsed, pct_opers);
+	RedisModule_Log(ctx, "debug", "query by id %lld in %llu microseconds", id, elapsed);
 	
 	return REDISMODULE_OK;
 }
@@ -431,10 +1189,10 @@ extern "C" int MVPTreeSize_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **arg
 
 	RedisModule_AutoMemory(ctx);
 	
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL){
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
 			RedisModule_ReplyWithError(ctx, "ERR - no such key");
 			return REDISMODULE_ERR;
 		}
@@ -445,7 +1203,7 @@ extern "C" int MVPTreeSize_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **arg
 
 	long long n_points;
 	try {
-		n_points = tree->Size();
+		n_points = VisitTree(index, [](auto *tree){ return tree->Size(); });
 	} catch (exception &ex){
 		RedisModule_ReplyWithError(ctx, "ERR - unable to get size");
 		return REDISMODULE_ERR;
@@ -461,10 +1219,10 @@ extern "C" int MVPTreeDelete_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **a
 
 	RedisModule_AutoMemory(ctx);
 	
-	MVPTree *tree = NULL;
+	ImageIndex *index = NULL;
 	try {
-		tree = GetMVPTree(ctx, argv[1]);
-		if (tree == NULL){
+		index = GetMVPTree(ctx, argv[1]);
+		if (index == NULL){
 			RedisModule_ReplyWithError(ctx, "ERR - no such key");
 			return REDISMODULE_ERR;
 		}
@@ -480,7 +1238,7 @@ extern "C" int MVPTreeDelete_RedisCmd(RedisModuleCtx *ctx, RedisModuleString **a
 	}
 
 	try {
-		tree->Delete(id);
+		VisitTree(index, [&](auto *tree){ tree->Delete(id); });
 	} catch (exception &ex){
 		RedisModule_ReplyWithError(ctx, "ERR - unable to delete id");
 		return REDISMODULE_ERR;
@@ -498,6 +1256,12 @@ extern "C" int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
 	int rc = REDISMODULE_OK;
 	if (RedisModule_Init(ctx, "imgscout", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
 		rc = REDISMODULE_ERR;
+
+	if (ParseModuleArgs(ctx, argv, argc) == REDISMODULE_ERR)
+		return REDISMODULE_ERR;
+
+	RedisModule_Log(ctx, "notice", "using %s distance kernels", DistanceKernelName());
+	RedisModule_Log(ctx, "notice", "prefetching %d nodes ahead", ImageTree<1>::prefetch_distance);
 	
 	RedisModuleTypeMethods tm = {.version = REDISMODULE_TYPE_METHOD_VERSION,
 	                             .rdb_load = MVPTreeTypeRdbLoad,
@@ -526,6 +1290,30 @@ extern "C" int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
 								  "readonly", 1, -1, 1) == REDISMODULE_ERR)
 		rc = REDISMODULE_ERR;
 
+	if (RedisModule_CreateCommand(ctx, "imgscout.querybyid", MVPTreeQueryById_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx, "imgscout.mquery", MVPTreeMultiQuery_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx, "imgscout.knn", MVPTreeKnn_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx, "imgscout.count", MVPTreeCount_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx, "imgscout.histogram", MVPTreeHistogram_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
+	if (RedisModule_CreateCommand(ctx, "imgscout.qscan", MVPTreeScan_RedisCmd,
+								  "readonly", 1, 1, 1) == REDISMODULE_ERR)
+		rc = REDISMODULE_ERR;
+
 	if (RedisModule_CreateCommand(ctx, "imgscout.lookup", MVPTreeLookup_RedisCmd,
 								  "readonly fast", 1, -1, 1) == REDISMODULE_ERR)
 		rc = REDISMODULE_ERR;
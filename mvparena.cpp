@@ -0,0 +1,716 @@
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+#include <queue>
+#include <algorithm>
+#include <limits>
+#include "mvptree.hpp"
+#include "mvparena.hpp"
+#include "distance.hpp"
+
+void* AlignedAlloc(const size_t n_bytes){
+	char *base = (char*)::operator new(n_bytes + MVP_CACHELINE + sizeof(void*));
+	uintptr_t addr = ((uintptr_t)(base + sizeof(void*)) + MVP_CACHELINE - 1) & ~(uintptr_t)(MVP_CACHELINE - 1);
+	((void**)addr)[-1] = base;
+	return (void*)addr;
+}
+
+void AlignedFree(void *ptr){
+	if (ptr != NULL) ::operator delete(((void**)ptr)[-1]);
+}
+
+atomic<uint32_t> MVPNodeSerial::last(0);
+
+/********** MVPFrozenInternal methods ************/
+
+static_assert(MVPDefaultLayout::Fanout == MVP_FANOUT && MVPDefaultLayout::NumSplits == MVP_NUMSPLITS,
+			  "layout agrees with defs.hpp");
+
+/* Select the nodes at level N of an internal node's splits, and below.  */
+/* Each level is its own instantiation, so that the split offsets are    */
+/* constant and the loop over levels unrolls.                            */
+template<class L, class M, int N, class S>
+static inline uint64_t SelectLevels(const MVPFrozenInternalT<L, M> *node, const typename M::PointType &target,
+									const typename M::DistanceType radius, const typename M::DistanceType window,
+									const uint64_t currnodes, typename M::DistanceType *qdists, S &sink){
+	if constexpr (N == L::LevelsPerNode){
+		return currnodes;
+	} else {
+		const int lengthM = L::BranchFactor - 1;
+
+		typename M::PointType vp(node->vpids[N], node->vpvalues[N]);
+		typename M::DistanceType d = PointDistance<M>(vp, target);
+		qdists[N] = d;
+		if (((node->vpactive >> N) & 1ULL) && d <= radius) sink.Add(node->vpids[N], d);
+
+		// bit i of nodes marks node i at level N of the node's splits
+		uint64_t nodes = currnodes, nextnodes = 0;
+		while (nodes){
+			int node_index = __builtin_ctzll(nodes);
+			nodes &= nodes - 1;
+			const typename M::SplitType *splits = node->splits[N] + node_index*lengthM;
+			if (splits[0] == M::NoSplit) continue;
+
+			typename M::DistanceType m = 0;
+			for (int j=0;j<lengthM;j++){
+				m = splits[j];
+				if (d <= m + window) nextnodes |= 1ULL << (node_index*L::BranchFactor+j);
+			}
+			if (d > m - window) nextnodes |= 1ULL << (node_index*L::BranchFactor+lengthM);
+		}
+		return SelectLevels<L, M, N+1>(node, target, radius, window, nextnodes, qdists, sink);
+	}
+}
+
+template<class L, class M>
+template<class S>
+uint64_t MVPFrozenInternalT<L, M>::SelectChildren(const Point &target, const DistanceType radius,
+												  const DistanceType window, DistanceType *qdists, S &sink)const{
+	static_assert(L::Fanout <= 64, "child selection is held in one 64-bit mask");
+	uint64_t selected = SelectLevels<L, M, 0>(this, target, radius, window, 1, qdists, sink);
+
+	uint64_t nodes = selected;
+	while (nodes){
+		int i = __builtin_ctzll(nodes);
+		nodes &= nodes - 1;
+		bool outside = false;
+		for (int n=0;n<L::LevelsPerNode;n++){
+			outside |= (qdists[n] + window < mindists[i][n]) | (qdists[n] > maxdists[i][n] + window);
+		}
+		if (outside || M::Bound(target, summaries[i]) > window) selected &= ~(1ULL << i);
+	}
+	return selected;
+}
+
+/* bitmask of the 64 distances within [lo, hi], in a loop of fixed */
+/* length that vectorizes                                            */
+template<typename D>
+static inline uint64_t MaskWithin(const D *dists, const D lo, const D hi){
+	uint64_t mask = 0;
+	for (int t=0;t<64;t++) mask |= (uint64_t)((dists[t] >= lo) & (dists[t] <= hi)) << t;
+	return mask;
+}
+
+template<class L, class M>
+uint64_t MVPFrozenInternalT<L, M>::SelectChildrenMulti(const Point *targets, const uint64_t active,
+													   const DistanceType radius, DistanceType (*qdists)[64],
+													   uint64_t *childtargets,
+													   list<QueryResult<DistanceType>> *results)const{
+	const int lengthM = L::BranchFactor - 1;
+	const DistanceType lowest = numeric_limits<DistanceType>::min();
+
+	// values of the active targets packed, for their distances to each
+	// vantage point to be computed as a block, then spread out by target
+	unsigned long long values[64*M::Words];
+	int slots[64];
+	int n_active = 0;
+	for (uint64_t bits=active;bits;bits&=bits-1){
+		int t = __builtin_ctzll(bits);
+		memcpy(values + n_active*M::Words, targets[t].value.data(), M::Words*sizeof(unsigned long long));
+		slots[n_active++] = t;
+	}
+
+	for (int n=0;n<L::LevelsPerNode;n++){
+		Point vp(vpids[n], vpvalues[n]);
+		DistanceType dists[64];
+		PointDistances<M>(vp, values, n_active, dists);
+		memset(qdists[n], 0, 64*sizeof(DistanceType));
+		for (int k=0;k<n_active;k++) qdists[n][slots[k]] = dists[k];
+
+		if ((vpactive >> n) & 1ULL){
+			for (uint64_t bits=active & MaskWithin(qdists[n], lowest, radius);bits;bits&=bits-1){
+				int t = __builtin_ctzll(bits);
+				MVPResultList<DistanceType> sink(results[t]);
+				sink.Add(vpids[n], qdists[n][t]);
+			}
+		}
+	}
+
+	// bit t of reach[k] marks target t as reaching node k at the current
+	// level of the node's splits
+	uint64_t reach[L::Fanout] = {active};
+	int n_nodes = 1;
+	for (int n=0;n<L::LevelsPerNode;n++){
+		uint64_t next[L::Fanout] = {0};
+		for (int k=0;k<n_nodes;k++){
+			if (reach[k] == 0) continue;
+			const typename M::SplitType *s = splits[n] + k*lengthM;
+			if (s[0] == M::NoSplit) continue;
+
+			DistanceType m = 0;
+			for (int j=0;j<lengthM;j++){
+				m = s[j];
+				next[k*L::BranchFactor+j] |= reach[k] & MaskWithin(qdists[n], lowest, m + radius);
+			}
+			next[k*L::BranchFactor+lengthM] |= reach[k] & ~MaskWithin(qdists[n], lowest, m - radius);
+		}
+		memcpy(reach, next, sizeof(next));
+		n_nodes *= L::BranchFactor;
+	}
+
+	uint64_t selected = 0;
+	for (int i=0;i<L::Fanout;i++){
+		uint64_t mask = reach[i];
+		for (int n=0;n<L::LevelsPerNode && mask;n++){
+			mask &= MaskWithin(qdists[n], (DistanceType)mindists[i][n] - radius, (DistanceType)maxdists[i][n] + radius);
+		}
+		for (uint64_t bits=mask;bits;bits&=bits-1){
+			int t = __builtin_ctzll(bits);
+			if (M::Bound(targets[t], summaries[i]) > radius) mask &= ~(1ULL << t);
+		}
+		childtargets[i] = mask;
+		if (mask) selected |= 1ULL << i;
+	}
+	return selected;
+}
+
+template<class L, class M>
+typename M::DistanceType MVPFrozenInternalT<L, M>::ChildBound(const int i, const Point &target,
+															  const DistanceType *qdists)const{
+	DistanceType bound = M::Bound(target, summaries[i]);
+	for (int n=0;n<L::LevelsPerNode;n++){
+		if (qdists[n] < mindists[i][n]) bound = max<DistanceType>(bound, mindists[i][n] - qdists[n]);
+		if (qdists[n] > maxdists[i][n]) bound = max<DistanceType>(bound, qdists[n] - maxdists[i][n]);
+	}
+	return bound;
+}
+
+/********** MVPFrozenLeaf methods ****************/
+
+/* scan leaf points for those within radius of target, given target's distances
+   to the leaf vantage points, qdists, and to the parent's, pathdists. Points are
+   first culled with the pivot distance table, by window, then the distances of
+   surviving points computed as a block.  Returns no. points found, with their
+   positions and distances in indices, dists. */
+template<class L, class M>
+int MVPFrozenLeafT<L, M>::ScanDataPoints(const Point &target, const DistanceType radius, const DistanceType window,
+										 const DistanceType *qdists, const DistanceType *pathdists,
+										 int *indices, DistanceType *dists)const{
+	int n_points = hdr.npoints;
+	const unsigned long long *values = Values();
+	const unsigned char *pdists = PivotDistances();
+
+	unsigned long long mask[L::LeafMaskWords];
+	for (int w=0;w<L::LeafMaskWords;w++) mask[w] = active[w];
+
+	// pivot distances are held to within PivotScale, keep those whose range
+	// may be within window of target's distance to the pivot
+	int n_rows = (pathdists != NULL) ? hdr.nvps + hdr.npath : hdr.nvps;
+	for (int i=0;i<n_rows;i++){
+		DistanceType q = (i < hdr.nvps) ? qdists[i] : pathdists[i - hdr.nvps];
+		int lo = (q > window) ? (q - window)/M::PivotScale : 0;
+		int hi = (q + window)/M::PivotScale;
+		PivotFilter(pdists + i*n_points, n_points, lo, hi, mask);
+	}
+
+	unsigned long long candidates[L::LeafCap*M::Words];
+	int n_candidates = 0;
+	for (int w=0;w<L::LeafMaskWords;w++){
+		unsigned long long bits = mask[w];
+		while (bits){
+			int j = w*64 + __builtin_ctzll(bits);
+			indices[n_candidates] = j;
+			memcpy(candidates + n_candidates*M::Words, values + j*M::Words, M::Words*sizeof(unsigned long long));
+			n_candidates++;
+			bits &= bits - 1;
+		}
+	}
+
+	PointDistances<M>(target, candidates, n_candidates, dists);
+
+	int n_results = 0;
+	for (int k=0;k<n_candidates;k++){
+		if (dists[k] <= radius){
+			indices[n_results] = indices[k];
+			dists[n_results++] = dists[k];
+		}
+	}
+	return n_results;
+}
+
+template<class L, class M>
+template<class S>
+void MVPFrozenLeafT<L, M>::TraverseNode(const Point &target, const DistanceType radius, const DistanceType window,
+										const DistanceType *pathdists, S &sink)const{
+	const long long *vpids = VpIds();
+	DistanceType qdists[MVP_PATHLENGTH];
+	PointDistances<M>(target, VpValues(), hdr.nvps, qdists);
+	for (int i=0;i<hdr.nvps;i++){
+		if (((vpactive >> i) & 1ULL) && qdists[i] <= radius) sink.Add(vpids[i], qdists[i]);
+	}
+
+	const long long *ids = Ids();
+	int indices[L::LeafCap];
+	DistanceType dists[L::LeafCap];
+	int n_results = ScanDataPoints(target, radius, window, qdists, pathdists, indices, dists);
+	for (int k=0;k<n_results;k++) sink.Add(ids[indices[k]], dists[k]);
+}
+
+/********** arena search *************************/
+
+void MVPBudget::Start(){
+	m_startops = MVPOpCount::n_ops;
+	m_deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+		chrono::duration<double, milli>(m_maxms));
+	m_spent = false;
+}
+
+bool MVPBudget::Spent(){
+	if (!m_spent){
+		m_spent = (m_maxops > 0 && MVPOpCount::n_ops - m_startops >= m_maxops)
+			|| (m_maxms > 0 && chrono::steady_clock::now() >= m_deadline);
+	}
+	return m_spent;
+}
+
+static inline void PrefetchLines(const MVPArena &arena, const uint32_t offset, const int start, const int n_lines){
+	const char *rec = (const char*)arena.At(offset);
+	for (int i=start;i<n_lines;i++) __builtin_prefetch(rec + i*MVP_CACHELINE, 0, 3);
+}
+
+/* target's distances to the vantage points of the ancestors of the leaf  */
+/* at depth that its path distances are to, out of those kept by depth in */
+/* qpath, NULL if they are not all kept                                   */
+template<class L, class M>
+static inline const typename M::DistanceType* LeafPath(const MVPFrozenLeafT<L, M> *leaf, const uint32_t depth,
+													   const typename M::DistanceType (*qpath)[L::LevelsPerNode]){
+	uint32_t n_nodes = leaf->PathNodes();
+	return (n_nodes > 0 && depth >= n_nodes && depth <= MVP_PATHDEPTH) ? qpath[depth - n_nodes] : NULL;
+}
+
+/* Depth first search of the arena.  Headers of the nodes next on the     */
+/* stack are prefetched up to prefetch nodes ahead, and the rest of a     */
+/* node's record as soon as it is popped, before it is evaluated, so      */
+/* that the misses on the lines of its arrays overlap.  Target's          */
+/* distances to the vantage points of each internal node on the current   */
+/* path are kept by depth, for leaves to filter on their path distances.  */
+/* The search ends early once the sink is done or the budget spent, or   */
+/* an approximate search has visited its most leaves.                    */
+template<class L, class M, class S>
+void SearchArena(const MVPArena &arena, const typename M::PointType &target, const typename M::DistanceType radius,
+				 const int prefetch, S &sink, MVPBudget *budget, const MVPApprox *approx){
+	typedef typename M::DistanceType DistanceType;
+	DistanceType qpath[MVP_PATHDEPTH][L::LevelsPerNode];
+	DistanceType window = (approx != NULL) ? approx->Window(radius) : radius;
+	int n_leaves = (approx != NULL && approx->maxleaves > 0) ? approx->maxleaves : -1;
+
+	MVPNodeStack nodes;
+	if (arena.GetRoot() != 0) nodes.Push(arena.GetRoot(), 0);
+	if (budget != NULL) budget->Start();
+
+	while (!nodes.Empty() && !sink.Done() && (budget == NULL || !budget->Spent())){
+		uint32_t depth;
+		uint32_t offset = nodes.Pop(depth);
+		const MVPFrozenNode *node = (const MVPFrozenNode*)arena.At(offset);
+		if (prefetch > 0){
+			PrefetchLines(arena, offset, 1, min<int>(node->n_lines, MVP_PREFETCHLINES));
+			if (nodes.Size() >= prefetch) PrefetchLines(arena, nodes.Peek(prefetch-1), 0, 1);
+		}
+
+		if (node->tag == MVP_INTERNAL){
+			const MVPFrozenInternalT<L, M> *internal = (const MVPFrozenInternalT<L, M>*)node;
+			DistanceType qdists[L::LevelsPerNode];
+			uint64_t selected = internal->SelectChildren(target, radius, window, qdists, sink);
+			if (depth < MVP_PATHDEPTH) memcpy(qpath[depth], qdists, sizeof(qdists));
+
+			// push in reverse, so that children are visited in order, or when
+			// leaves are capped in order of their bounds, nearest first
+			int n_pushed = 0;
+			if (n_leaves > 0){
+				pair<DistanceType, uint32_t> children[L::Fanout];
+				for ( ;selected;selected&=selected-1){
+					int i = __builtin_ctzll(selected);
+					if (internal->children[i] != 0)
+						children[n_pushed++] = make_pair(internal->ChildBound(i, target, qdists), internal->children[i]);
+				}
+				sort(children, children + n_pushed, greater<pair<DistanceType, uint32_t>>());
+				for (int k=0;k<n_pushed;k++) nodes.Push(children[k].second, depth+1);
+			}
+			while (selected){
+				int i = 63 - __builtin_clzll(selected);
+				selected &= ~(1ULL << i);
+				if (internal->children[i] != 0){
+					nodes.Push(internal->children[i], depth+1);
+					n_pushed++;
+				}
+			}
+
+			// headers of the children to be visited first
+			for (int k=0;k<min(prefetch, n_pushed);k++){
+				PrefetchLines(arena, nodes.Peek(k), 0, 1);
+			}
+		} else {
+			const MVPFrozenLeafT<L, M> *leaf = (const MVPFrozenLeafT<L, M>*)node;
+			leaf->TraverseNode(target, radius, window, LeafPath(leaf, depth, qpath), sink);
+			if (--n_leaves == 0) break;
+		}
+	}
+}
+
+/* Depth first search of the arena that can be paused and resumed.  The  */
+/* stack of a depth first search holds the later selected siblings of    */
+/* the next node to visit and of each of its ancestors, so the path to   */
+/* that node is enough to rebuild it, by selecting again the children of */
+/* the nodes along the path.  Their vantage points were given to the     */
+/* sink when they were first visited, and are not given again.  Only     */
+/* child links are followed, so that any path is safe to resume from.    */
+/* Nodes keep their places as points are added, but a subtree rebuilt   */
+/* while the search was paused is laid out anew, and its part of the    */
+/* path means nothing.  The search resumes at the root of such a        */
+/* subtree, giving again the points of it already given, but missing    */
+/* none.                                                                 */
+template<class L, class M, class S>
+bool SearchArenaResume(const MVPArena &arena, const typename M::PointType &target,
+					   const typename M::DistanceType radius, const uint32_t since,
+					   vector<int> &path, S &sink){
+	typedef typename M::DistanceType DistanceType;
+
+	struct Entry {
+		uint32_t offset;
+		uint32_t depth;
+		int index;      /* among its parent's children */
+	};
+
+	// sink for vantage points already given
+	struct Ignore {
+		void Add(const long long, const DistanceType){}
+	} ignore;
+
+	DistanceType qpath[MVP_PATHDEPTH][L::LevelsPerNode];
+	vector<Entry> nodes;
+	if (arena.GetRoot() == 0){
+		path.clear();
+		return false;
+	}
+
+	uint32_t offset = arena.GetRoot();
+	for (size_t depth=0;depth<path.size();depth++){
+		const MVPFrozenNode *node = (const MVPFrozenNode*)arena.At(offset);
+		if (MVPNodeSerial::After(node->serial, since)){
+			path.resize(depth);
+			break;
+		}
+		int index = path[depth];
+		if (node->tag != MVP_INTERNAL || index < 0 || index >= L::Fanout)
+			throw invalid_argument("no such node in arena");
+		const MVPFrozenInternalT<L, M> *internal = (const MVPFrozenInternalT<L, M>*)node;
+		if (internal->children[index] == 0)
+			throw invalid_argument("no such node in arena");
+
+		DistanceType qdists[L::LevelsPerNode];
+		uint64_t selected = internal->SelectChildren(target, radius, radius, qdists, ignore);
+		if (depth < MVP_PATHDEPTH) memcpy(qpath[depth], qdists, sizeof(qdists));
+
+		// siblings after the one taken, to be visited once its subtree is done
+		for (int i=L::Fanout-1;i>index;i--){
+			if (((selected >> i) & 1ULL) && internal->children[i] != 0)
+				nodes.push_back({internal->children[i], (uint32_t)depth+1, i});
+		}
+		offset = internal->children[index];
+	}
+	nodes.push_back({offset, (uint32_t)path.size(), path.empty() ? -1 : path.back()});
+
+	// child indices from the root to the node last visited
+	vector<int> current = path;
+	while (!nodes.empty()){
+		if (sink.Done()){
+			const Entry &next = nodes.back();
+			path.assign(current.begin(), current.begin() + (next.depth - 1));
+			path.push_back(next.index);
+			return true;
+		}
+
+		Entry entry = nodes.back();
+		nodes.pop_back();
+		if (entry.depth > 0){
+			current.resize(entry.depth - 1);
+			current.push_back(entry.index);
+		}
+		const MVPFrozenNode *node = (const MVPFrozenNode*)arena.At(entry.offset);
+
+		if (node->tag == MVP_INTERNAL){
+			const MVPFrozenInternalT<L, M> *internal = (const MVPFrozenInternalT<L, M>*)node;
+			DistanceType qdists[L::LevelsPerNode];
+			uint64_t selected = internal->SelectChildren(target, radius, radius, qdists, sink);
+			if (entry.depth < MVP_PATHDEPTH) memcpy(qpath[entry.depth], qdists, sizeof(qdists));
+
+			while (selected){
+				int i = 63 - __builtin_clzll(selected);
+				selected &= ~(1ULL << i);
+				if (internal->children[i] != 0) nodes.push_back({internal->children[i], entry.depth+1, i});
+			}
+		} else {
+			const MVPFrozenLeafT<L, M> *leaf = (const MVPFrozenLeafT<L, M>*)node;
+			leaf->TraverseNode(target, radius, radius, LeafPath(leaf, entry.depth, qpath), sink);
+		}
+	}
+
+	path.clear();
+	return false;
+}
+
+/* Depth first search of the arena for many targets at once, in groups */
+/* of up to 64.  Each node on the stack carries the mask of the targets */
+/* that selected it, so that it is loaded once for them all and the     */
+/* search of a subtree is shared by every target still within reach of  */
+/* it, and an internal node's children are selected for all of them    */
+/* together.  Targets' distances to the vantage points on the current   */
+/* path are kept by depth, as for one target.                           */
+template<class L, class M>
+void SearchArenaMulti(const MVPArena &arena, const vector<typename M::PointType> &targets,
+					  const typename M::DistanceType radius, const int prefetch,
+					  vector<list<QueryResult<typename M::DistanceType>>> &results){
+	typedef typename M::DistanceType DistanceType;
+
+	struct Entry {
+		uint32_t offset;
+		uint32_t depth;
+		uint64_t targets;
+	};
+
+	results.resize(targets.size());
+	if (arena.GetRoot() == 0) return;
+
+	// qpath[depth][n][t] is target t's distance to vantage point n of the node at depth
+	vector<DistanceType> qpath(MVP_PATHDEPTH*L::LevelsPerNode*64);
+	vector<Entry> nodes;
+	for (size_t first=0;first<targets.size();first+=64){
+		int n_group = min<size_t>(64, targets.size() - first);
+		const typename M::PointType *group = targets.data() + first;
+		list<QueryResult<DistanceType>> *groupresults = results.data() + first;
+
+		uint64_t all = (n_group == 64) ? ~0ULL : (1ULL << n_group) - 1;
+		nodes.push_back({arena.GetRoot(), 0, all});
+
+		while (!nodes.empty()){
+			Entry entry = nodes.back();
+			nodes.pop_back();
+			const MVPFrozenNode *node = (const MVPFrozenNode*)arena.At(entry.offset);
+			if (prefetch > 0) PrefetchLines(arena, entry.offset, 1, min<int>(node->n_lines, MVP_PREFETCHLINES));
+
+			if (node->tag == MVP_INTERNAL){
+				const MVPFrozenInternalT<L, M> *internal = (const MVPFrozenInternalT<L, M>*)node;
+
+				// bit t of childtargets[i] marks target t as selecting child i
+				uint64_t childtargets[L::Fanout];
+				DistanceType qdists[L::LevelsPerNode][64];
+				uint64_t selected = internal->SelectChildrenMulti(group, entry.targets, radius, qdists,
+																   childtargets, groupresults);
+				if (entry.depth < MVP_PATHDEPTH)
+					memcpy(&qpath[entry.depth*L::LevelsPerNode*64], qdists, sizeof(qdists));
+
+				// push in reverse, so that children are visited in order
+				while (selected){
+					int i = 63 - __builtin_clzll(selected);
+					selected &= ~(1ULL << i);
+					if (internal->children[i] != 0) nodes.push_back({internal->children[i], entry.depth+1, childtargets[i]});
+				}
+			} else {
+				const MVPFrozenLeafT<L, M> *leaf = (const MVPFrozenLeafT<L, M>*)node;
+				uint32_t n_nodes = leaf->PathNodes();
+				bool haspath = (n_nodes > 0 && entry.depth >= n_nodes && entry.depth <= MVP_PATHDEPTH);
+				for (uint64_t bits=entry.targets;bits;bits&=bits-1){
+					int t = __builtin_ctzll(bits);
+					DistanceType pathdists[MVP_LEAFPATH*L::LevelsPerNode];
+					for (int p=0;p<(int)n_nodes*L::LevelsPerNode && haspath;p++)
+						pathdists[p] = qpath[((entry.depth-n_nodes)*L::LevelsPerNode + p)*64 + t];
+					MVPResultList<DistanceType> sink(groupresults[t]);
+					leaf->TraverseNode(group[t], radius, radius, haspath ? pathdists : NULL, sink);
+				}
+			}
+		}
+	}
+}
+
+/* Best first search of the arena.  Nodes are visited in order of the   */
+/* lower bounds on their distances from target, and the k nearest points */
+/* found so far kept in a max-heap.  Once k are held, the radius searched */
+/* shrinks to just within the farthest of them, and the search ends when  */
+/* the next node's bound exceeds it, or if not sorted ends there and      */
+/* then.  Each node queued carries target's distances to the vantage     */
+/* points of its nearest MVP_LEAFPATH ancestors, for leaves to filter on. */
+/* An approximate search prunes by the relaxed window of the radius       */
+/* searched.                                                              */
+template<class L, class M>
+void SearchArenaNearest(const MVPArena &arena, const typename M::PointType &target, const int k,
+						const typename M::DistanceType maxradius, const bool sorted,
+						list<QueryResult<typename M::DistanceType>> &results, MVPBudget *budget,
+						const MVPApprox *approx){
+	typedef typename M::DistanceType DistanceType;
+	typedef QueryResult<DistanceType> Result;
+
+	struct Entry {
+		DistanceType bound;
+		uint32_t offset;
+		int npath;                                  /* no. ancestors' distances held */
+		DistanceType pathdists[MVP_LEAFPATH][L::LevelsPerNode]; /* in order of depth */
+		bool operator<(const Entry &other)const{ return bound > other.bound; }
+	};
+
+	if (k <= 0 || arena.GetRoot() == 0) return;
+
+	// sink keeping the k nearest offered
+	struct Nearest {
+		priority_queue<pair<DistanceType, long long>> heap;
+		int k;
+
+		void Add(const long long id, const DistanceType d){
+			if ((int)heap.size() < k){
+				heap.push(make_pair(d, id));
+			} else if (d < heap.top().first){
+				heap.pop();
+				heap.push(make_pair(d, id));
+			}
+		}
+	} nearest;
+	nearest.k = k;
+	auto radius = [&](){
+		if ((int)nearest.heap.size() < k) return maxradius;
+		return sorted ? nearest.heap.top().first - 1 : -1;
+	};
+	auto window = [&](){
+		return (approx != NULL) ? approx->Window(radius()) : radius();
+	};
+	int n_leaves = (approx != NULL && approx->maxleaves > 0) ? approx->maxleaves : -1;
+
+	priority_queue<Entry> nodes;
+	Entry root;
+	root.bound = 0;
+	root.offset = arena.GetRoot();
+	root.npath = 0;
+	nodes.push(root);
+	if (budget != NULL) budget->Start();
+
+	while (!nodes.empty() && nodes.top().bound <= window() && (budget == NULL || !budget->Spent())){
+		Entry entry = nodes.top();
+		nodes.pop();
+		const MVPFrozenNode *node = (const MVPFrozenNode*)arena.At(entry.offset);
+
+		if (node->tag == MVP_INTERNAL){
+			const MVPFrozenInternalT<L, M> *internal = (const MVPFrozenInternalT<L, M>*)node;
+			DistanceType qdists[L::LevelsPerNode];
+			uint64_t selected = internal->SelectChildren(target, radius(), window(), qdists, nearest);
+
+			// the farthest ancestor's distances drop off once MVP_LEAFPATH are held
+			Entry child;
+			int n_kept = min(entry.npath, MVP_LEAFPATH - 1);
+			memcpy(child.pathdists, entry.pathdists[entry.npath - n_kept], n_kept*sizeof(qdists));
+			memcpy(child.pathdists[n_kept], qdists, sizeof(qdists));
+			child.npath = n_kept + 1;
+
+			while (selected){
+				int i = __builtin_ctzll(selected);
+				selected &= selected - 1;
+				if (internal->children[i] == 0) continue;
+				child.bound = internal->ChildBound(i, target, qdists);
+				child.offset = internal->children[i];
+				if (child.bound <= window()) nodes.push(child);
+			}
+		} else {
+			const MVPFrozenLeafT<L, M> *leaf = (const MVPFrozenLeafT<L, M>*)node;
+			const long long *vpids = leaf->VpIds();
+			DistanceType qdists[MVP_PATHLENGTH];
+			PointDistances<M>(target, leaf->VpValues(), node->nvps, qdists);
+			for (int i=0;i<node->nvps;i++){
+				if (((leaf->vpactive >> i) & 1ULL) && qdists[i] <= radius()) nearest.Add(vpids[i], qdists[i]);
+			}
+
+			const long long *ids = leaf->Ids();
+			int indices[L::LeafCap];
+			DistanceType dists[L::LeafCap];
+			int n_nodes = leaf->PathNodes();
+			const DistanceType *pathdists = (n_nodes > 0 && entry.npath >= n_nodes)
+				? entry.pathdists[entry.npath - n_nodes] : NULL;
+			int n_results = leaf->ScanDataPoints(target, radius(), window(), qdists, pathdists, indices, dists);
+			for (int j=0;j<n_results;j++) nearest.Add(ids[indices[j]], dists[j]);
+			if (--n_leaves == 0) break;
+		}
+	}
+
+	// the heap gives the farthest first
+	while (!nearest.heap.empty()){
+		Result r;
+		r.distance = nearest.heap.top().first;
+		r.id = nearest.heap.top().second;
+		results.push_front(r);
+		nearest.heap.pop();
+	}
+}
+
+#define MVP_INSTANTIATE_ARENA(W) \
+	template struct MVPFrozenInternalT<MVPDefaultLayout, HammingMetric<W>>; \
+	template struct MVPFrozenLeafT<MVPDefaultLayout, HammingMetric<W>>; \
+	template void SearchArena<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const DataPoint<W>&, \
+		const int, const int, MVPResultList<int>&, MVPBudget*, const MVPApprox*); \
+	template void SearchArena<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const DataPoint<W>&, \
+		const int, const int, MVPResultCount<int>&, MVPBudget*, const MVPApprox*); \
+	template void SearchArena<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const DataPoint<W>&, \
+		const int, const int, MVPResultHistogram<int>&, MVPBudget*, const MVPApprox*); \
+	template bool SearchArenaResume<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const DataPoint<W>&, \
+		const int, const uint32_t, vector<int>&, MVPResultChunk<int>&); \
+	template void SearchArenaNearest<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const DataPoint<W>&, \
+		const int, const int, const bool, list<QueryResult<int>>&, MVPBudget*, const MVPApprox*); \
+	template void SearchArenaMulti<MVPDefaultLayout, HammingMetric<W>>(const MVPArena&, const vector<DataPoint<W>>&, \
+		const int, const int, vector<list<QueryResult<int>>>&);
+
+MVP_FOR_EACH_HASH_WORDS(MVP_INSTANTIATE_ARENA)
+
+/********** MVPArena methods *********************/
+
+MVPArena::~MVPArena(){
+	AlignedFree(m_block);
+}
+
+/* reserve n_bytes, rounded up to whole cache lines, at the end of the arena */
+uint32_t MVPArena::Allocate(const size_t n_bytes){
+	size_t n_lines = (n_bytes + MVP_CACHELINE - 1)/MVP_CACHELINE;
+	if (m_used == 0) m_used = 1;  // offset 0 is reserved for null
+	if (m_used + n_lines > UINT32_MAX)
+		throw length_error("arena exceeds 32-bit offsets");
+
+	if (m_used + n_lines > m_capacity){
+		size_t capacity = (m_capacity > 0) ? m_capacity : 64;
+		while (capacity < m_used + n_lines) capacity *= 2;
+		char *block = (char*)AlignedAlloc(capacity*MVP_CACHELINE);
+		if (m_block != NULL){
+			memcpy(block, m_block, m_used*MVP_CACHELINE);
+			AlignedFree(m_block);
+		}
+		m_block = block;
+		m_capacity = capacity;
+	}
+
+	uint32_t offset = m_used;
+	m_used += n_lines;
+
+	MVPFrozenNode *node = (MVPFrozenNode*)At(offset);
+	memset(node, 0, n_lines*MVP_CACHELINE);
+	node->n_lines = n_lines;
+	return offset;
+}
+
+/* count a record no longer reachable from the root as garbage */
+void MVPArena::Release(const uint32_t offset){
+	if (offset != 0 && offset < m_used){
+		MVPFrozenNode *node = (MVPFrozenNode*)At(offset);
+		m_garbage += node->n_lines;
+	}
+}
+
+/* discard all records, keeping the block for reuse */
+void MVPArena::Reset(){
+	m_used = 0;
+	m_garbage = 0;
+	m_root = 0;
+}
+
+void MVPArena::Clear(){
+	AlignedFree(m_block);
+	m_block = NULL;
+	m_capacity = 0;
+	Reset();
+}
+
+size_t MVPArena::MemoryUsage()const{
+	return (m_block != NULL) ? m_capacity*MVP_CACHELINE + MVP_CACHELINE + sizeof(void*) : 0;
+}
@@ -0,0 +1,380 @@
+#ifndef _MVPARENA_H
+#define _MVPARENA_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <vector>
+#include "datapoint.hpp"
+
+using namespace std;
+
+/* cache-line aligned blocks, allocated through operator new */
+void* AlignedAlloc(const size_t n_bytes);
+
+void AlignedFree(void *ptr);
+
+/* node kinds, tagged on both live nodes and their frozen records */
+#define MVP_INTERNAL 1
+#define MVP_LEAF 2
+
+constexpr int MVPPow(const int base, const int exp){
+	return (exp == 0) ? 1 : base*MVPPow(base, exp-1);
+}
+
+/* Shape of the tree as compile-time constants, so that loops over the */
+/* levels, splits and children of a node have constant bounds.         */
+template<int BF, int LPN, int LEAFCAP>
+struct MVPLayout {
+	static const int BranchFactor = BF;
+	static const int LevelsPerNode = LPN;
+	static const int LeafCap = LEAFCAP;
+	static const int Fanout = MVPPow(BF, LPN);
+	static const int NumSplits = (BF-1)*MVPPow(BF, LPN-1);
+	static const int LeafMaskWords = (LEAFCAP+63)/64;
+};
+
+typedef MVPLayout<MVP_BRANCHFACTOR, MVP_LEVELSPERNODE, MVP_LEAFCAP> MVPDefaultLayout;
+
+/* Frozen node records.  Each record begins on a cache line of the arena */
+/* and is referred to by its offset in cache lines; offset 0 is null.    */
+
+struct MVPFrozenNode {
+	unsigned char tag;
+	unsigned char nvps;
+	unsigned char npath;
+	unsigned short npoints;
+	uint32_t n_lines;
+	uint32_t serial;
+};
+
+/* Serial no. given each node as it is created, shared by all trees, so */
+/* that a paused search can tell the nodes created since.  Serials wrap, */
+/* so are compared by their difference.                                  */
+struct MVPNodeSerial {
+	static atomic<uint32_t> last;
+
+	static uint32_t Next(){ return ++last; }
+
+	/* whether serial was given after then */
+	static bool After(const uint32_t serial, const uint32_t then){ return (int32_t)(serial - then) > 0; }
+};
+
+/* Sinks take the points a search finds, by id and distance, and tell */
+/* it by Done when it may stop.                                        */
+
+/* results in order of distance */
+template<typename D>
+struct MVPResultList {
+	list<QueryResult<D>> &results;
+
+	MVPResultList(list<QueryResult<D>> &results):results(results){}
+
+	void Add(const long long id, const D distance){
+		QueryResult<D> item;
+		item.id = id;
+		item.distance = distance;
+		auto iter = results.begin();
+		while (iter != results.end() && iter->distance < distance) iter++;
+		results.insert(iter, item);
+	}
+
+	bool Done()const{ return false; }
+};
+
+/* results in the order found, done once cap are held */
+template<typename D>
+struct MVPResultChunk {
+	list<QueryResult<D>> &results;
+	size_t cap;
+
+	MVPResultChunk(list<QueryResult<D>> &results, const size_t cap):results(results),cap(cap){}
+
+	void Add(const long long id, const D distance){
+		QueryResult<D> item;
+		item.id = id;
+		item.distance = distance;
+		results.push_back(item);
+	}
+
+	bool Done()const{ return results.size() >= cap; }
+};
+
+/* no. points found, up to cap if cap > 0 */
+template<typename D>
+struct MVPResultCount {
+	long long count;
+	long long cap;
+
+	MVPResultCount(const long long cap):count(0),cap(cap){}
+
+	void Add(const long long, const D){ count++; }
+
+	bool Done()const{ return cap > 0 && count >= cap; }
+};
+
+/* no. points found at each distance, counts sized to the radius + 1 */
+template<typename D>
+struct MVPResultHistogram {
+	vector<long long> &counts;
+
+	MVPResultHistogram(vector<long long> &counts):counts(counts){}
+
+	void Add(const long long, const D distance){ counts[distance]++; }
+
+	bool Done()const{ return false; }
+};
+
+/* Limit on the work of one search, in distance operations and in   */
+/* milliseconds, 0 for no limit.  The search checks it before each    */
+/* node it visits, and once it is spent stops there, keeping what it  */
+/* has found.                                                         */
+class MVPBudget {
+private:
+	long long m_maxops;
+	double m_maxms;
+	long long m_startops;
+	chrono::steady_clock::time_point m_deadline;
+	bool m_spent;
+
+public:
+	MVPBudget(const long long max_ops, const double max_ms)
+		:m_maxops(max_ops),m_maxms(max_ms),m_startops(0),m_spent(false){};
+
+	/* begin counting, as the search starts */
+	void Start();
+
+	bool Spent();
+
+	/* whether the search ran to the end within the budget */
+	bool Completed()const{ return !m_spent; }
+};
+
+/* Relaxed pruning for approximate search.  Nodes and leaf points are   */
+/* pruned as though the radius were radius/(1 + eps), so that fewer are */
+/* visited at the cost of missing some points near its edge, and no     */
+/* more than maxleaves leaves are visited if maxleaves > 0.  The points */
+/* found are still those within the full radius.                        */
+struct MVPApprox {
+	double eps;
+	int maxleaves;
+
+	MVPApprox(const double eps, const int maxleaves):eps(eps),maxleaves(maxleaves){};
+
+	/* radius to prune by */
+	template<typename D>
+	D Window(const D radius)const{
+		return (radius < 0) ? radius : (D)floor(radius/(1.0 + eps));
+	}
+};
+
+template<class L, class M>
+struct MVPFrozenInternalT {
+	typedef typename M::PointType Point;
+	typedef typename M::DistanceType DistanceType;
+
+	MVPFrozenNode hdr;
+	unsigned long long vpactive;
+	HashValue<M::Words> vpvalues[L::LevelsPerNode];
+	long long vpids[L::LevelsPerNode];
+	typename M::SplitType splits[L::LevelsPerNode][L::NumSplits];
+	uint32_t children[L::Fanout];
+	typename M::SplitType mindists[L::Fanout][L::LevelsPerNode];
+	typename M::SplitType maxdists[L::Fanout][L::LevelsPerNode];
+	typename M::SummaryType summaries[L::Fanout];
+
+	/* give vantage points within radius to sink and return the bitmask   */
+	/* of children that may hold points within window of target, by the  */
+	/* vantage point splits, then by the ranges of the children's         */
+	/* distances to the vantage points and lastly their summaries.        */
+	/* window is radius, or less for an approximate search.  target's     */
+	/* distances to the vantage points are left in qdists                 */
+	template<class S>
+	uint64_t SelectChildren(const Point &target, const DistanceType radius, const DistanceType window,
+							DistanceType *qdists, S &sink)const;
+
+	/* SelectChildren for up to 64 targets at once, those of the bitmask  */
+	/* active.  Each vantage point's distances to all the active targets  */
+	/* are computed as one block, and the splits, ranges of the children  */
+	/* and summaries tested for the targets together as bitmasks.  Target */
+	/* t's vantage points within radius are added to results[t] and its   */
+	/* distance to vantage point n left in qdists[n][t].  Bit t of        */
+	/* childtargets[i] is set if target t selects child i; returns the    */
+	/* bitmask of children selected by any.                               */
+	uint64_t SelectChildrenMulti(const Point *targets, const uint64_t active, const DistanceType radius,
+								 DistanceType (*qdists)[64], uint64_t *childtargets,
+								 list<QueryResult<DistanceType>> *results)const;
+
+	/* lower bound on the distance from target to any point under child i, */
+	/* by its summary and the ranges of its distances to the vantage       */
+	/* points, given target's distances to them in qdists                   */
+	DistanceType ChildBound(const int i, const Point &target, const DistanceType *qdists)const;
+};
+
+/* header followed by the same arrays as an MVPLeaf block:            */
+/*   values[npoints][words] ids[npoints]                              */
+/*   vpvalues[nvps][words] vpids[nvps] pdists[nvps+npath][npoints]    */
+/*   vppaths[nvps][npath]                                             */
+template<class L, class M>
+struct MVPFrozenLeafT {
+	typedef typename M::PointType Point;
+	typedef typename M::DistanceType DistanceType;
+
+	MVPFrozenNode hdr;
+	unsigned long long vpactive;
+	unsigned long long active[L::LeafMaskWords];
+
+	const unsigned long long* Values()const{ return (const unsigned long long*)(this + 1); }
+	const long long* Ids()const{ return (const long long*)(Values() + hdr.npoints*M::Words); }
+	const unsigned long long* VpValues()const{ return (const unsigned long long*)(Ids() + hdr.npoints); }
+	const long long* VpIds()const{ return (const long long*)(VpValues() + hdr.nvps*M::Words); }
+	const unsigned char* PivotDistances()const{ return (const unsigned char*)(VpIds() + hdr.nvps); }
+
+	/* no. ancestors the points' path distances are to */
+	int PathNodes()const{ return hdr.npath/L::LevelsPerNode; }
+
+	/* pathdists are target's distances to the vantage points of the    */
+	/* nearest PathNodes() ancestors in order of depth, NULL if not     */
+	/* known.  Points are culled by their pivot distances within        */
+	/* window, as for SelectChildren                                     */
+	int ScanDataPoints(const Point &target, const DistanceType radius, const DistanceType window,
+					   const DistanceType *qdists, const DistanceType *pathdists,
+					   int *indices, DistanceType *dists)const;
+
+	template<class S>
+	void TraverseNode(const Point &target, const DistanceType radius, const DistanceType window,
+					  const DistanceType *pathdists, S &sink)const;
+};
+
+/* Stack of node offsets for a depth-first traversal of the arena,     */
+/* each with the node's depth in the tree.  The first MVP_STACKSIZE     */
+/* entries are held inline, only deeper stacks spill over to the heap.  */
+class MVPNodeStack {
+private:
+	struct Entry {
+		uint32_t offset;
+		uint32_t depth;
+	};
+
+	Entry m_nodes[MVP_STACKSIZE];
+	vector<Entry> m_spill;
+	int m_size;
+
+public:
+	MVPNodeStack():m_size(0){};
+
+	void Push(const uint32_t offset, const uint32_t depth){
+		Entry entry = {offset, depth};
+		if (m_size < MVP_STACKSIZE) m_nodes[m_size] = entry;
+		else m_spill.push_back(entry);
+		m_size++;
+	}
+
+	uint32_t Pop(uint32_t &depth){
+		m_size--;
+		Entry entry;
+		if (m_size < MVP_STACKSIZE){
+			entry = m_nodes[m_size];
+		} else {
+			entry = m_spill.back();
+			m_spill.pop_back();
+		}
+		depth = entry.depth;
+		return entry.offset;
+	}
+
+	/* offset k entries below the top of the stack */
+	uint32_t Peek(const int k)const{
+		int i = m_size - 1 - k;
+		return (i < MVP_STACKSIZE) ? m_nodes[i].offset : m_spill[i - MVP_STACKSIZE].offset;
+	}
+
+	int Size()const{ return m_size; }
+
+	bool Empty()const{ return m_size == 0; }
+};
+
+/* Immutable, flattened layout of an MVPTree.  Nodes are laid out       */
+/* breadth first in one cache-line aligned block, the children of each  */
+/* internal node contiguous, and linked by 32-bit offsets.  Records     */
+/* replaced after the layout was built are appended at the end and the  */
+/* old ones counted as garbage until the next full layout.              */
+class MVPArena {
+private:
+	char *m_block;
+	size_t m_capacity;   /* in cache lines */
+	size_t m_used;       /* in cache lines */
+	size_t m_garbage;    /* in cache lines */
+	uint32_t m_root;
+
+public:
+	MVPArena():m_block(NULL),m_capacity(0),m_used(0),m_garbage(0),m_root(0){};
+
+	~MVPArena();
+
+	uint32_t Allocate(const size_t n_bytes);
+
+	void Release(const uint32_t offset);
+
+	void Reset();
+
+	void Clear();
+
+	void* At(const uint32_t offset)const{
+		return (void*)(m_block + (size_t)offset*MVP_CACHELINE);
+	}
+
+	uint32_t GetRoot()const{ return m_root; }
+
+	void SetRoot(const uint32_t offset){ m_root = offset; }
+
+	size_t Used()const{ return m_used; }
+
+	size_t Garbage()const{ return m_garbage; }
+
+	size_t MemoryUsage()const;
+};
+
+/* give all points in the arena within radius of target to sink, until */
+/* it is done or budget, if given, is spent, prefetching the records of */
+/* the next prefetch nodes to be visited.  With approx, only those      */
+/* found by the relaxed search.                                         */
+template<class L, class M, class S>
+void SearchArena(const MVPArena &arena, const typename M::PointType &target, const typename M::DistanceType radius,
+				 const int prefetch, S &sink, MVPBudget *budget = NULL, const MVPApprox *approx = NULL);
+
+/* give the points in the arena within radius of target to sink, in    */
+/* depth first order, resuming at the node reached by path, the indices */
+/* of the children taken from the root, or at the root if path is empty, */
+/* and pausing at the first node boundary once sink is done.  path is   */
+/* left at the next node to visit.  A node on the path created after    */
+/* serial since holds a subtree rebuilt since the search paused, and    */
+/* the search resumes there instead.  Returns true if paused, false     */
+/* with path empty once the search is done.  Throws invalid_argument if */
+/* path does not lead to a node of the arena.                           */
+template<class L, class M, class S>
+bool SearchArenaResume(const MVPArena &arena, const typename M::PointType &target,
+					   const typename M::DistanceType radius, const uint32_t since,
+					   vector<int> &path, S &sink);
+
+/* add the points in the arena within radius of each of targets to its */
+/* list of results, in one traversal shared by all the targets         */
+template<class L, class M>
+void SearchArenaMulti(const MVPArena &arena, const vector<typename M::PointType> &targets,
+					  const typename M::DistanceType radius, const int prefetch,
+					  vector<list<QueryResult<typename M::DistanceType>>> &results);
+
+/* add the k points in the arena nearest to target, within maxradius, */
+/* to results in order of distance, or if not sorted the first k      */
+/* within maxradius found, searching no further than budget if given, */
+/* and with approx only as far as the relaxed search                  */
+template<class L, class M>
+void SearchArenaNearest(const MVPArena &arena, const typename M::PointType &target, const int k,
+						const typename M::DistanceType maxradius, const bool sorted,
+						list<QueryResult<typename M::DistanceType>> &results, MVPBudget *budget = NULL,
+						const MVPApprox *approx = NULL);
+
+#endif /* _MVPARENA_H */
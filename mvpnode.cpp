@@ -1,342 +1,562 @@
 #include <iostream>
+#include <cstdint>
 #include "mvptree.hpp"
 #include "mvpnode.hpp"
 
-static double PointDistance(const DataPoint *a, const DataPoint *b){
-	MVPTree::n_ops++;
-	return __builtin_popcountll((a->value)^(b->value));
-}
-
-bool CompareDistance(const double a, const double b, const bool less){
+template<typename D>
+static inline bool CompareDistance(const D a, const D b, const bool less){
 	if (less) return (a <= b);
 	return (a > b);
 }
 
+static_assert(MVP_PATHLENGTH <= 64, "leaf vantage point flags are held in one 64-bit word");
+
+/* random draws for the node at level with key, a hash of its path from */
+/* the root, the same on every build for a given seed however its       */
+/* subtrees are scheduled.  The seed is mixed with the node's position   */
+/* by splitmix64 steps, cheaper than a seed_seq per node                 */
+template<class M>
+static mt19937_64 NodeRandom(const int level, const unsigned long long key){
+	unsigned long long z = MVPTree<M>::vp_seed;
+	for (unsigned long long v : {(unsigned long long)level, key}){
+		z += v + 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+		z ^= z >> 31;
+	}
+	return mt19937_64(z);
+}
+
+/* Remove a vantage point from points and return it.  Of a few candidates */
+/* drawn at random, the one with the fewest points of a random sample     */
+/* lying close to the median of their distances from it is taken, as     */
+/* those are the points that queries near the split must search on both  */
+/* sides of it.  A point inside a cluster of near duplicates has most of  */
+/* the sample at much the same distance and is passed over.               */
+template<class M>
+static MVPBuildPoint<M> TakeVantagePoint(vector<MVPBuildPoint<M>> &points, mt19937_64 &rng){
+	typedef typename M::DistanceType DistanceType;
+	const DistanceType band = max<DistanceType>(M::MaxDistance/32, 1);
+
+	int n_points = points.size();
+	int n_candidates = min(MVPTree<M>::vp_candidates, n_points);
+	if (n_candidates > 0 && n_points > 2){
+		int n_sample = min(MVP_VPSAMPLE, n_points);
+		int sample[MVP_VPSAMPLE];
+		for (int k=0;k<n_sample;k++) sample[k] = rng() % n_points;
+
+		int best = -1, best_close = n_sample + 1;
+		for (int c=0;c<n_candidates;c++){
+			int i = rng() % n_points;
+			DistanceType dists[MVP_VPSAMPLE];
+			for (int k=0;k<n_sample;k++) dists[k] = PointDistance<M>(points[i].point, points[sample[k]].point);
+			nth_element(dists, dists + n_sample/2, dists + n_sample);
+			DistanceType median = dists[n_sample/2];
+
+			int n_close = 0;
+			for (int k=0;k<n_sample;k++){
+				if (dists[k] >= median - band && dists[k] <= median + band) n_close++;
+			}
+			if (n_close < best_close){
+				best = i;
+				best_close = n_close;
+			}
+		}
+		swap(points[best], points.back());
+	}
+
+	MVPBuildPoint<M> vp = points.back();
+	points.pop_back();
+	return vp;
+}
+
+/* no. path distances that all of points hold, those of MVP_LEAFPATH */
+/* nodes if there are no points                                     */
+template<class M>
+static int PathLength(const vector<MVPBuildPoint<M>> &points){
+	int n_nodes = MVP_LEAFPATH;
+	for (const MVPBuildPoint<M> &bp : points) n_nodes = min<int>(n_nodes, bp.npath);
+	return n_nodes*MVP_LEVELSPERNODE;
+}
+
 /********** MVPNode methods *********************/
 
-MVPNode* MVPNode::CreateNode(vector<DataPoint*> &points,
-							 map<int, vector<DataPoint*>*> &childpoints,
-							 int level, int index){
-	MVPNode *node = NULL;
+template<class M>
+MVPNode<M>* MVPNode<M>::CreateNode(vector<BuildPoint> &points,
+							 map<int, vector<BuildPoint>*> &childpoints,
+							 int level, unsigned long long key){
+	MVPNode<M> *node = NULL;
 	if (points.size() <= MVP_LEAFCAP + MVP_PATHLENGTH){
-		node = new MVPLeaf();
+		node = new MVPLeaf<M>();
 	} else {
-		node = new MVPInternal();
+		node = new MVPInternal<M>();
 	}
 
-	node = node->AddDataPoints(points, childpoints, level, index);
+	node = node->AddDataPoints(points, childpoints, level, key);
 	if (node == NULL) throw runtime_error("unable to create node");
 	return node;
 }
 
-void MVPNode::InsertItemIntoList(list<QueryResult> &list, QueryResult &item)const{
-	auto iter = list.begin();
-	for ( ;iter != list.end();iter++){
-		if (item.distance <= iter->distance){
-			list.insert(iter, item);
-			break;
-		}
-	}
-	if (iter == list.end()){
-		list.insert(iter, item);
-	}
-}
-
 /********** MVPInternal methods *******************/
-MVPInternal::MVPInternal(){
+template<class M>
+MVPInternal<M>::MVPInternal():MVPNode<M>(MVP_INTERNAL){
 	m_nvps = 0;
 	for (int i=0;i<MVP_FANOUT;i++) m_childnodes[i] = NULL;
 	for (int i=0;i<MVP_LEVELSPERNODE;i++){
 		for (int j=0;j<MVP_NUMSPLITS;j++){
-			m_splits[i][j] = -1.0;
+			m_splits[i][j] = M::NoSplit;
+		}
+	}
+	for (int i=0;i<MVP_FANOUT;i++){
+		for (int n=0;n<MVP_LEVELSPERNODE;n++){
+			m_mindists[i][n] = numeric_limits<SplitType>::max();
+			m_maxdists[i][n] = 0;
 		}
+		m_counts[i] = 0;
 	}
+	m_buildcount = 0;
 }
 
-void MVPInternal::SelectVantagePoints(vector<DataPoint*> &points){
+template<class M>
+void MVPInternal<M>::SelectVantagePoints(vector<BuildPoint> &points, mt19937_64 &rng){
 	while (m_nvps < MVP_LEVELSPERNODE && points.size() > 0){
-		m_vps[m_nvps++] = points.back();
-		points.pop_back();
+		m_vps[m_nvps++] = TakeVantagePoint<M>(points, rng).point;
 	}
 }
 
-void MVPInternal::CalcSplitPoints(const vector<double> &dists, int n, int split_index){
+/* kth least of the distances counted in counts */
+template<typename D>
+static D NthDistance(const int *counts, int k){
+	D d = 0;
+	while (k >= counts[d]) k -= counts[d++];
+	return d;
+}
+
+/* split points at the quantiles of n_dists distances, given as counts */
+/* of each distance from 0 to the metric's MaxDistance                 */
+template<class M>
+void MVPInternal<M>::CalcSplitPoints(const int *counts, const int n_dists, int n, int split_index){
 	int lengthM = MVP_BRANCHFACTOR - 1;
-	if (dists.size() > 0){
-		if (m_splits[n][split_index*lengthM] == -1){
-			vector<double> tmpdists = dists;
-			sort(tmpdists.begin(), tmpdists.end());
-			double factor = (double)tmpdists.size()/(double)MVP_BRANCHFACTOR;
+	if (n_dists > 0){
+		if (m_splits[n][split_index*lengthM] == M::NoSplit){
+			double factor = (double)n_dists/(double)MVP_BRANCHFACTOR;
 			for (int i=0;i<lengthM;i++){
 				double pos = (i+1)*factor;
 				int lo = floor(pos);
-				int hi = (pos <= tmpdists.size()-1) ? ceil(pos) : 0;
-				m_splits[n][split_index*lengthM+i] = (tmpdists[lo] + tmpdists[hi])/2.0;
+				int hi = (pos <= n_dists-1) ? ceil(pos) : 0;
+				// integer distances route the same on floor of the median
+				m_splits[n][split_index*lengthM+i] = (SplitType)((NthDistance<DistanceType>(counts, lo)
+																  + NthDistance<DistanceType>(counts, hi))/2);
 			}
 		}
 	}
 }
 
+/* Route points to the node's children.  At each level the points of each */
+/* node of the splits lie in one contiguous range, which is partitioned   */
+/* stably into the ranges of its BF children by counting, into a second   */
+/* buffer that then takes the place of the first, so that each level is   */
+/* linear in the no. points.  Their distances to the vantage points go    */
+/* first in their paths.                                                  */
+template<class M>
+void MVPInternal<M>::CollatePoints(vector<BuildPoint> &points,
+								map<int, vector<BuildPoint>*> &childpoints){
+	int lengthM = MVP_BRANCHFACTOR - 1;
+	int n_points = points.size();
+	if (m_buildcount == 0) m_buildcount = m_nvps + n_points;
 
-vector<double> MVPInternal::CalcPointDistances(DataPoint &vp, vector<DataPoint*> &points){
-	vector<double> results;
-	for (DataPoint *dp : points){
-		results.push_back(PointDistance(&vp, dp));
-	}
-	return results;
-}
+	for (BuildPoint &bp : points) bp.PushPath();
+	vector<BuildPoint> buffer(n_points);
+	vector<unsigned char> branches(n_points);
 
-vector<DataPoint*>* MVPInternal::CullPoints(vector<DataPoint*> &list, vector<double> &dists,
-							  double split, bool less){
-	vector<DataPoint*> *results = new vector<DataPoint*>();
+	// starts[i] is the start of node i's range, up to starts[n_nodes]
+	int starts[MVP_FANOUT+1] = {0, n_points};
+	int nextstarts[MVP_FANOUT+1];
+	int n_nodes = 1;
 
-	vector<DataPoint*>::iterator list_iter = list.begin();
-	vector<double>::iterator dist_iter = dists.begin(); 
-	while (list_iter != list.end() && dist_iter != dists.end()){
-		if (CompareDistance(*dist_iter,split,less)){
-			results->push_back(*list_iter);
-			list_iter = list.erase(list_iter);
-			dist_iter = dists.erase(dist_iter);
-		} else {
-			list_iter++;
-			dist_iter++;
+	int counts[M::MaxDistance+1];
+	for (int n=0;n<MVP_LEVELSPERNODE;n++){
+		for (int node_index=0;node_index<n_nodes;node_index++){
+			int start = starts[node_index], end = starts[node_index+1];
+
+			for (DistanceType d=0;d<=M::MaxDistance;d++) counts[d] = 0;
+			for (int k=start;k<end;k++){
+				DistanceType d = PointDistance<M>(m_vps[n], points[k].point);
+				points[k].path[0][n] = d;
+				counts[d]++;
+			}
+			CalcSplitPoints(counts, end - start, n, node_index);
+
+			int branchcounts[MVP_BRANCHFACTOR] = {0};
+			const SplitType *splits = m_splits[n] + node_index*lengthM;
+			for (int k=start;k<end;k++){
+				int j = 0;
+				while (j < lengthM && !CompareDistance<DistanceType>(points[k].path[0][n], splits[j], true)) j++;
+				branches[k] = j;
+				branchcounts[j]++;
+			}
+
+			int offsets[MVP_BRANCHFACTOR];
+			for (int j=0, pos=start;j<MVP_BRANCHFACTOR;j++){
+				offsets[j] = pos;
+				nextstarts[node_index*MVP_BRANCHFACTOR+j] = pos;
+				pos += branchcounts[j];
+			}
+			for (int k=start;k<end;k++) buffer[offsets[branches[k]]++] = points[k];
 		}
+		n_nodes *= MVP_BRANCHFACTOR;
+		nextstarts[n_nodes] = n_points;
+		memcpy(starts, nextstarts, (n_nodes+1)*sizeof(int));
+		points.swap(buffer);
 	}
-	if (results->size() > 0){
-		return results;
+
+	for (int i=0;i<MVP_FANOUT;i++){
+		if (starts[i] < starts[i+1]){
+			vector<BuildPoint> *list = new vector<BuildPoint>(points.begin() + starts[i], points.begin() + starts[i+1]);
+			MarkChildBounds(i, *list);
+			m_counts[i] += list->size();
+			childpoints[i] = list;
+		}
 	}
-	delete results;
-	return NULL;
+	points.clear();
 }
 
-void MVPInternal::CollatePoints(vector<DataPoint*> &points,
-								map<int, vector<DataPoint*>*> &childpoints,
-								const int level, const int index){
-	map<int, vector<DataPoint*>*> pnts, pnts2;
-	pnts[0] = &points;
-
-	int lengthM = MVP_BRANCHFACTOR - 1;
-	int n = 0;
-	do {
-		for (auto iter=pnts.begin();iter!=pnts.end();iter++){
-			int node_index = iter->first;
-			vector<DataPoint*> *list = iter->second;
-
-			int list_size = list->size();
-
-			vector<double> dists = CalcPointDistances(*m_vps[n], *list);
-			if (dists.size() > 0){
-				CalcSplitPoints(dists, n, node_index);
-
-				double m;
-				vector<DataPoint*> *culledpts = NULL;
-				for (int j=0;j<lengthM;j++){
-					m = m_splits[n][node_index*lengthM+j];
-
-					culledpts = CullPoints(*list, dists, m, true);
-					if (culledpts != NULL){
-						pnts2[node_index*MVP_BRANCHFACTOR+j] = culledpts;
-					}
-				}
-				m = m_splits[n][node_index*lengthM+lengthM-1];
-				culledpts = CullPoints(*list, dists, m, false);
-				if (culledpts != NULL){
-					pnts2[node_index*MVP_BRANCHFACTOR+MVP_BRANCHFACTOR-1] = culledpts;
-				}
-			}
-			if (list->size() > 0)
-				throw length_error("not fully collated");
-
-			if (n > 0) delete list;
+/* widen the child's summary and distance ranges to cover points, */
+/* given their path distances to the vantage points               */
+template<class M>
+void MVPInternal<M>::MarkChildBounds(const int child, const vector<BuildPoint> &points){
+	for (const BuildPoint &bp : points){
+		M::Summarize(m_summaries[child], bp.point);
+		for (int n=0;n<m_nvps;n++){
+			SplitType d = bp.path[0][n];
+			if (d < m_mindists[child][n]) m_mindists[child][n] = d;
+			if (d > m_maxdists[child][n]) m_maxdists[child][n] = d;
 		}
-		pnts = move(pnts2);
-		n++;
-	} while (n < MVP_LEVELSPERNODE);
-
-	for (auto iter=pnts.begin();iter!=pnts.end();iter++){
-		int i=iter->first;
-		vector<DataPoint*> *list = iter->second;
-		if (list != NULL)
-			childpoints[index*MVP_FANOUT+i] = list;  
 	}
-	
 }
 
-MVPNode* MVPInternal::AddDataPoints(vector<DataPoint*> &points,
-									map<int,vector<DataPoint*>*> &childpoints,
-									const int level, const int index){
-	SelectVantagePoints(points);
+template<class M>
+MVPNode<M>* MVPInternal<M>::AddDataPoints(vector<BuildPoint> &points,
+									map<int,vector<BuildPoint>*> &childpoints,
+									const int level, const unsigned long long key){
+	if (m_nvps < MVP_LEVELSPERNODE){
+		mt19937_64 rng = NodeRandom<M>(level, key);
+		SelectVantagePoints(points, rng);
+	}
 	if (m_nvps < MVP_LEVELSPERNODE) throw invalid_argument("too few points for internal node");
-	CollatePoints(points, childpoints, level, index);
+	CollatePoints(points, childpoints);
 	points.clear();
 	return this;
 }
 
-const int MVPInternal::GetCount()const{
+template<class M>
+const int MVPInternal<M>::GetCount()const{
 	return 0;
 }
 
-void MVPInternal::SetChildNode(const int n, MVPNode *node){
+template<class M>
+void MVPInternal<M>::SetChildNode(const int n, MVPNode<M> *node){
 	if (n < 0 || n >= MVP_FANOUT) throw invalid_argument("index out of range");
 	m_childnodes[n] = node;
 }
 
-MVPNode* MVPInternal::GetChildNode(const int n)const{
+template<class M>
+MVPNode<M>* MVPInternal<M>::GetChildNode(const int n)const{
 	if (n < 0 || n >= MVP_FANOUT) throw invalid_argument("index out of range");
 	return m_childnodes[n];
 }
 
-const vector<DataPoint*> MVPInternal::GetVantagePoints()const{
-	vector<DataPoint*> results;
+template<class M>
+const vector<typename M::PointType> MVPInternal<M>::GetVantagePoints()const{
+	vector<Point> results;
 	for (int i=0;i<m_nvps;i++) results.push_back(m_vps[i]);
 	return results;
 }
 
-const vector<DataPoint*> MVPInternal::GetDataPoints()const{
-	vector<DataPoint*> results;
+template<class M>
+const vector<typename M::PointType> MVPInternal<M>::GetDataPoints()const{
+	vector<Point> results;
 	return results;
 }
 
-const vector<DataPoint*> MVPInternal::FilterDataPoints(const DataPoint *target, const double radius)const{
-	vector<DataPoint*> results;
+template<class M>
+bool MVPInternal<M>::DeactivatePoint(const Point &dp, int &child){
 	for (int i=0;i<m_nvps;i++){
-		if (!m_vps[i]->active) continue;
-		double d = PointDistance(target, m_vps[i]);
-		if (d <= radius){
-			results.push_back(m_vps[i]);
+		if (m_vps[i].id == dp.id && m_vps[i].active){
+			m_vps[i].active = false;
+			return true;
 		}
 	}
 
-	return results;
+	child = RouteChild(dp);
+	return false;
 }
 
-void MVPInternal::TraverseNode(const DataPoint &target, const double radius, map<int, MVPNode*> &childnodes,
-							   const int index, list<QueryResult> &results)const{
+template<class M>
+int MVPInternal<M>::RouteChild(const Point &dp)const{
+	// follow the same route CollatePoints took
 	int lengthM = MVP_BRANCHFACTOR - 1;
-	int n = 0;
-	bool *currnodes  = new bool[1];
-	currnodes[0] = true;
-	do {
-		int n_nodes = pow(MVP_BRANCHFACTOR, n);
-		int n_childnodes = pow(MVP_BRANCHFACTOR, n+1);
-		bool *nextnodes = new bool[n_childnodes];
-		for (int i=0;i<n_childnodes;i++) nextnodes[i] = false;
-
-		double d = PointDistance(m_vps[n], &target);
-		if (m_vps[n]->active && d <= radius){
-			QueryResult r;
-			r.dp = m_vps[n];
-			r.distance = d;
-			InsertItemIntoList(results, r);
-		}
-
-		int lengthMn = lengthM*n_nodes;
-		for (int node_index=0;node_index<n_nodes;node_index++){
-			if (currnodes[node_index]){
-				if (m_splits[n][node_index*lengthM] >= 0){
-					double m = m_splits[n][node_index*lengthM];
-					for (int j=0;j<lengthM;j++){
-						m = m_splits[n][node_index*lengthM+j];
-						if (d <= m + radius) nextnodes[node_index*MVP_BRANCHFACTOR+j] = true;
-					}
-					if (d > m - radius) nextnodes[node_index*MVP_BRANCHFACTOR+MVP_BRANCHFACTOR-1] = true;
-				}
-			}
-		}
+	int node_index = 0;
+	for (int n=0;n<m_nvps;n++){
+		DistanceType d = PointDistance<M>(m_vps[n], dp);
+		int j = 0;
+		while (j < lengthM && !CompareDistance<DistanceType>(d, m_splits[n][node_index*lengthM+j], true)) j++;
+		node_index = node_index*MVP_BRANCHFACTOR + j;
+	}
+	return node_index;
+}
 
-		delete[] currnodes;
-		currnodes = nextnodes;
-		n++;
-	} while (n < MVP_LEVELSPERNODE);
+template<class M>
+long long MVPInternal<M>::GetSubtreeCount()const{
+	long long n_points = m_nvps;
+	for (int i=0;i<MVP_FANOUT;i++) n_points += m_counts[i];
+	return n_points;
+}
 
+template<class M>
+bool MVPInternal<M>::IsUnbalanced()const{
+	long long n_points = 0, most = 0;
 	for (int i=0;i<MVP_FANOUT;i++){
-		if (currnodes[i]){
-			MVPNode *child = GetChildNode(i);
-			if (child != NULL)
-				childnodes[index*MVP_FANOUT+i] = child;
-		}
+		n_points += m_counts[i];
+		most = max<long long>(most, m_counts[i]);
 	}
-
-	delete[] currnodes;
-
+	return (n_points >= MVP_REBUILDMIN && n_points >= 2LL*m_buildcount
+			&& most*MVP_FANOUT > MVP_IMBALANCE*n_points);
 }
 
-const vector<DataPoint*> MVPInternal::PurgeDataPoints(){
-	vector<DataPoint*> results;
+template<class M>
+const vector<MVPBuildPoint<M>> MVPInternal<M>::PurgeDataPoints(){
+	vector<BuildPoint> results;
 	for (int i=0;i<m_nvps;i++){
-		if (!m_vps[i]->active)
-			delete m_vps[i];
-		else
-			results.push_back(m_vps[i]);
+		if (m_vps[i].active)
+			results.push_back(BuildPoint(m_vps[i]));
 	}
 	
 	return results;
 }
 
+template<class M>
+size_t MVPInternal<M>::MemoryUsage()const{
+	return sizeof(MVPInternal<M>);
+}
+
+template<class M>
+size_t MVPInternal<M>::FrozenSize()const{
+	return sizeof(MVPFrozenInternalT<MVPDefaultLayout, M>);
+}
+
+template<class M>
+void MVPInternal<M>::WriteFrozen(void *rec, const uint32_t *childoffsets)const{
+	MVPFrozenInternalT<MVPDefaultLayout, M> *node = (MVPFrozenInternalT<MVPDefaultLayout, M>*)rec;
+	node->hdr.tag = MVP_INTERNAL;
+	node->hdr.nvps = m_nvps;
+	node->hdr.npath = 0;
+	node->hdr.npoints = 0;
+	node->hdr.serial = this->m_serial;
+	node->vpactive = 0;
+	for (int i=0;i<m_nvps;i++){
+		node->vpvalues[i] = m_vps[i].value;
+		node->vpids[i] = m_vps[i].id;
+		if (m_vps[i].active) node->vpactive |= (1ULL << i);
+	}
+	memcpy(node->splits, m_splits, sizeof(m_splits));
+	memcpy(node->children, childoffsets, MVP_FANOUT*sizeof(uint32_t));
+	for (int i=0;i<MVP_FANOUT;i++) node->summaries[i] = m_summaries[i];
+	memcpy(node->mindists, m_mindists, sizeof(m_mindists));
+	memcpy(node->maxdists, m_maxdists, sizeof(m_maxdists));
+}
+
 
 /********* MVPLeaf methods **********************/
 
-MVPLeaf::MVPLeaf(){
+template<class M>
+MVPLeaf<M>::MVPLeaf():MVPNode<M>(MVP_LEAF){
 	m_nvps = 0;
-	for (int i=0;i<MVP_PATHLENGTH;i++)
-		for (int j=0;j<MVP_LEAFCAP;j++)
-			m_pdists[i][j] = -1.0;
+	m_npath = 0;
+	m_npoints = 0;
+	m_values = NULL;
+	m_ids = NULL;
+	m_vpvalues = NULL;
+	m_vpids = NULL;
+	m_pdists = NULL;
+	m_vppaths = NULL;
+	for (int w=0;w<MVP_LEAFMASKWORDS;w++) m_active[w] = 0;
+	m_vpactive = 0;
+}
+
+template<class M>
+MVPLeaf<M>::~MVPLeaf(){
+	AlignedFree(m_values);
+}
+
+template<class M>
+size_t MVPLeaf<M>::BlockSize(const int nvps, const int npath, const int npoints){
+	return npoints*(M::Words*sizeof(unsigned long long) + sizeof(long long))
+		+ nvps*(M::Words*sizeof(unsigned long long) + sizeof(long long))
+		+ (nvps + npath)*npoints*sizeof(unsigned char)
+		+ nvps*npath*sizeof(unsigned char);
+}
+
+/* reallocate the leaf's block for nvps vantage points and npoints points
+   with npath path distances, carrying over the current contents.  Of the
+   path distances, those to the nearest ancestors are kept. */
+template<class M>
+void MVPLeaf<M>::ResizeBlock(const int nvps, const int npoints, const int npath){
+	if (nvps < m_nvps || npoints < m_npoints || npath > m_npath)
+		throw invalid_argument("leaf block cannot shrink, nor its path grow");
+
+	char *block = NULL;
+	if (nvps > 0 || npoints > 0) block = (char*)AlignedAlloc(BlockSize(nvps, npath, npoints));
+
+	unsigned long long *values = (unsigned long long*)block;
+	long long *ids = (long long*)(values + npoints*M::Words);
+	unsigned long long *vpvalues = (unsigned long long*)(ids + npoints);
+	long long *vpids = (long long*)(vpvalues + nvps*M::Words);
+	unsigned char *pdists = (unsigned char*)(vpids + nvps);
+	unsigned char *vppaths = pdists + (nvps + npath)*npoints;
+
+	if (m_values != NULL){
+		int dropped = m_npath - npath;
+		memcpy(values, m_values, m_npoints*M::Words*sizeof(unsigned long long));
+		memcpy(ids, m_ids, m_npoints*sizeof(long long));
+		memcpy(vpvalues, m_vpvalues, m_nvps*M::Words*sizeof(unsigned long long));
+		memcpy(vpids, m_vpids, m_nvps*sizeof(long long));
+		for (int i=0;i<m_nvps;i++)
+			memcpy(pdists + i*npoints, m_pdists + i*m_npoints, m_npoints);
+		for (int p=0;p<npath;p++)
+			memcpy(pdists + (nvps+p)*npoints, m_pdists + (m_nvps+dropped+p)*m_npoints, m_npoints);
+		for (int i=0;i<m_nvps;i++)
+			memcpy(vppaths + i*npath, m_vppaths + i*m_npath + dropped, npath);
+		AlignedFree(m_values);
+	}
+
+	m_values = values;
+	m_ids = ids;
+	m_vpvalues = vpvalues;
+	m_vpids = vpids;
+	m_pdists = pdists;
+	m_vppaths = vppaths;
+	m_npath = npath;
+}
+
+/* vantage point i, with its path distances as held */
+template<class M>
+MVPBuildPoint<M> MVPLeaf<M>::VantagePoint(const int i)const{
+	BuildPoint bp(Point(m_vpids[i], m_vpvalues + i*M::Words));
+	bp.point.active = (m_vpactive >> i) & 1ULL;
+	bp.npath = m_npath/MVP_LEVELSPERNODE;
+	for (int p=0;p<m_npath;p++)
+		bp.path[bp.npath - 1 - p/MVP_LEVELSPERNODE][p%MVP_LEVELSPERNODE] = m_vppaths[i*m_npath+p]*M::PivotScale;
+	return bp;
+}
+
+/* leaf point j, with its path distances as held */
+template<class M>
+MVPBuildPoint<M> MVPLeaf<M>::LeafPoint(const int j)const{
+	BuildPoint bp(Point(m_ids[j], m_values + j*M::Words));
+	bp.point.active = (m_active[j/64] >> (j%64)) & 1ULL;
+	bp.npath = m_npath/MVP_LEVELSPERNODE;
+	for (int p=0;p<m_npath;p++)
+		bp.path[bp.npath - 1 - p/MVP_LEVELSPERNODE][p%MVP_LEVELSPERNODE] = m_pdists[(m_nvps+p)*m_npoints+j]*M::PivotScale;
+	return bp;
 }
 
-void MVPLeaf::SelectVantagePoints(vector<DataPoint*> &points){
-	while (m_nvps < MVP_PATHLENGTH && points.size() > 0){
-		m_vps[m_nvps++] = points.back();
-		points.pop_back();
+/* path distance p of the leaf, in order of depth, of a point's path, */
+/* the nearest first, divided by PivotScale                           */
+template<class M>
+static inline unsigned char LeafPathDistance(const MVPBuildPoint<M> &bp, const int npath, const int p){
+	int n_nodes = npath/MVP_LEVELSPERNODE;
+	return (unsigned char)(bp.path[n_nodes - 1 - p/MVP_LEVELSPERNODE][p%MVP_LEVELSPERNODE]/M::PivotScale);
+}
+
+template<class M>
+void MVPLeaf<M>::SelectVantagePoints(vector<BuildPoint> &points, mt19937_64 &rng){
+	int n_vps = min<int>(MVP_PATHLENGTH - m_nvps, points.size());
+	if (n_vps <= 0) return;
+	if (m_npoints > 0) throw invalid_argument("vantage points must precede leaf points");
+
+	ResizeBlock(m_nvps + n_vps, 0, m_npath);
+	while (n_vps-- > 0){
+		const BuildPoint vp = TakeVantagePoint<M>(points, rng);
+		memcpy(m_vpvalues + m_nvps*M::Words, vp.point.value.data(), M::Words*sizeof(unsigned long long));
+		m_vpids[m_nvps] = vp.point.id;
+		for (int p=0;p<m_npath;p++) m_vppaths[m_nvps*m_npath+p] = LeafPathDistance<M>(vp, m_npath, p);
+		m_vpactive |= (1ULL << m_nvps);
+		m_nvps++;
 	}
 }
 
-void MVPLeaf::MarkLeafDistances(vector<DataPoint*> &points){
-	if (m_points.size() + points.size() > MVP_LEAFCAP)
-		throw invalid_argument("no. points exceed leaf capacity");
-	
+/* fill in pivot distances for the points from start onwards */
+template<class M>
+void MVPLeaf<M>::MarkLeafDistances(const int start){
+	DistanceType dists[MVP_LEAFCAP];
 	for (int m = 0; m < m_nvps;m++){
-		int index = m_points.size();
-		for (DataPoint *dp : points){
-			m_pdists[m][index++] = PointDistance(m_vps[m], dp);
+		Point vp(m_vpids[m], m_vpvalues + m*M::Words);
+		PointDistances<M>(vp, m_values + start*M::Words, m_npoints - start, dists);
+		for (int k=start;k<m_npoints;k++){
+			m_pdists[m*m_npoints+k] = (unsigned char)(dists[k-start]/M::PivotScale);
 		}
 	}
 }
 
-MVPNode* MVPLeaf::AddDataPoints(vector<DataPoint*> &points,
-								map<int,vector<DataPoint*>*> &childpoints,
-								const int level, const int index){
-	SelectVantagePoints(points);
-	MVPNode *retnode = this;
-	if (m_points.size() + points.size() <= MVP_LEAFCAP){ 
+template<class M>
+void MVPLeaf<M>::AppendDataPoints(vector<BuildPoint> &points){
+	if (points.empty()) return;
+	if (m_npoints + points.size() > MVP_LEAFCAP)
+		throw invalid_argument("no. points exceed leaf capacity");
+
+	int start = m_npoints;
+	int n_points = m_npoints + points.size();
+	ResizeBlock(m_nvps, n_points, m_npath);
+	for (BuildPoint &bp : points){
+		memcpy(m_values + m_npoints*M::Words, bp.point.value.data(), M::Words*sizeof(unsigned long long));
+		m_ids[m_npoints] = bp.point.id;
+		for (int p=0;p<m_npath;p++)
+			m_pdists[(m_nvps+p)*n_points+m_npoints] = LeafPathDistance<M>(bp, m_npath, p);
+		m_active[m_npoints/64] |= (1ULL << (m_npoints%64));
+		m_npoints++;
+	}
+	MarkLeafDistances(start);
+	points.clear();
+}
+
+template<class M>
+MVPNode<M>* MVPLeaf<M>::AddDataPoints(vector<BuildPoint> &points,
+								map<int,vector<BuildPoint>*> &childpoints,
+								const int level, const unsigned long long key){
+	// the path distances kept are those all the leaf's points carry, fewer
+	// for points of a subtree rebuilt beneath the leaf's nearest ancestors
+	int npath = PathLength<M>(points);
+	if (m_nvps == 0 && m_npoints == 0) m_npath = npath;
+	else if (npath < m_npath) ResizeBlock(m_nvps, m_npoints, npath);
+
+	mt19937_64 rng = NodeRandom<M>(level, key);
+	SelectVantagePoints(points, rng);
+	MVPNode<M> *retnode = this;
+	if (m_npoints + points.size() <= MVP_LEAFCAP){ 
 		// add points to existing leaf
-		MarkLeafDistances(points);
-		for (DataPoint *dp : points){
-			dp->active = true;
-			m_points.push_back(dp);
-		}
-		points.clear();
+		AppendDataPoints(points);
 	} else {  // create new internal node 
 
 		// get existing points, purge inactive poins
-		vector<DataPoint*> pts = PurgeDataPoints();
+		vector<BuildPoint> pts = PurgeDataPoints();
 
 		// merge points
-		for (DataPoint *dp : pts) points.push_back(dp);
+		for (BuildPoint &bp : pts) points.push_back(bp);
 
 		if (points.size() <= MVP_LEAFCAP + MVP_PATHLENGTH){
 			// clear out points
+			AlignedFree(m_values);
+			m_values = NULL;
 			m_nvps = 0;
-			m_points.clear();
-			SelectVantagePoints(points);
-			MarkLeafDistances(points);
-			for (DataPoint *dp : points){
-				dp->active = true;
-				m_points.push_back(dp);
-			}
-			points.clear();
+			m_npoints = 0;
+			for (int w=0;w<MVP_LEAFMASKWORDS;w++) m_active[w] = 0;
+			m_vpactive = 0;
+			SelectVantagePoints(points, rng);
+			AppendDataPoints(points);
 		} else {
-			retnode = new MVPInternal();
-			retnode = retnode->AddDataPoints(points, childpoints, level, index);
+			retnode = new MVPInternal<M>();
+			retnode = retnode->AddDataPoints(points, childpoints, level, key);
 		}
 	}
 	if (retnode == NULL) throw runtime_error("unable to create node");
@@ -344,109 +564,93 @@ MVPNode* MVPLeaf::AddDataPoints(vector<DataPoint*> &points,
 	return retnode;
 }
 
-const int MVPLeaf::GetCount()const{
-	return m_points.size();
+template<class M>
+const int MVPLeaf<M>::GetCount()const{
+	return m_npoints;
 }
 
-void MVPLeaf::SetChildNode(const int n, MVPNode* node){}
+template<class M>
+void MVPLeaf<M>::SetChildNode(const int, MVPNode<M>*){}
 
-MVPNode* MVPLeaf::GetChildNode(const int n)const{return NULL;}
+template<class M>
+MVPNode<M>* MVPLeaf<M>::GetChildNode(const int)const{return NULL;}
 
-const vector<DataPoint*> MVPLeaf::GetVantagePoints()const{
-	vector<DataPoint*> results;
-	for (int i=0;i<m_nvps;i++) results.push_back(m_vps[i]);
+template<class M>
+const vector<typename M::PointType> MVPLeaf<M>::GetVantagePoints()const{
+	vector<Point> results;
+	for (int i=0;i<m_nvps;i++) results.push_back(VantagePoint(i).point);
 	return results;
 }
 
-const vector<DataPoint*> MVPLeaf::GetDataPoints()const{
-	vector<DataPoint*> results;
-	for (DataPoint *dp : m_points) results.push_back(dp);
+template<class M>
+const vector<typename M::PointType> MVPLeaf<M>::GetDataPoints()const{
+	vector<Point> results;
+	for (int j=0;j<m_npoints;j++) results.push_back(LeafPoint(j).point);
 	return results;
 }
 
-const vector<DataPoint*> MVPLeaf::FilterDataPoints(const DataPoint *target, const double radius)const{
-	vector<DataPoint*> results;
-
-	double qdists[MVP_PATHLENGTH];
+template<class M>
+bool MVPLeaf<M>::DeactivatePoint(const Point &dp, int &child){
+	child = -1;
 	for (int i=0;i<m_nvps;i++){
-		qdists[i] = PointDistance(m_vps[i], target);
-		if (m_vps[i]->active && qdists[i] <= radius){
-			results.push_back(m_vps[i]);
+		if (m_vpids[i] == dp.id && ((m_vpactive >> i) & 1ULL)){
+			m_vpactive &= ~(1ULL << i);
+			return true;
 		}
 	}
-	
-	for (int j=0;j < (int)m_points.size();j++){
-		bool skip = false;
-		if (!m_points[j]->active) continue;
-		
-		for (int i=0;i<m_nvps;i++){
-			if (!(m_pdists[i][j] >= qdists[i] - radius) && (m_pdists[i][j] <= qdists[i] + radius)){
-				skip = true;
-				break;
-			}
-		}
-		if (!skip){
-			double d = PointDistance(m_points[j], target);
-			if (d <= radius){
-				results.push_back(m_points[j]);
-			}
+	for (int j=0;j<m_npoints;j++){
+		if (m_ids[j] == dp.id && ((m_active[j/64] >> (j%64)) & 1ULL)){
+			m_active[j/64] &= ~(1ULL << (j%64));
+			return true;
 		}
 	}
-	return results;
+	return false;
 }
 
-
-void MVPLeaf::TraverseNode(const DataPoint &target, const double radius,
-						   map<int, MVPNode*> &childnodes,
-						   const int index, list<QueryResult> &results)const{
-	double qdists[MVP_PATHLENGTH];
+template<class M>
+const vector<MVPBuildPoint<M>> MVPLeaf<M>::PurgeDataPoints(){
+	vector<BuildPoint> results;
 	for (int i=0;i<m_nvps;i++){
-		qdists[i] = PointDistance(m_vps[i], &target);
-		if (m_vps[i]->active && qdists[i] <= radius){
-			QueryResult item;
-			item.dp = m_vps[i];
-			item.distance = qdists[i];
-			InsertItemIntoList(results, item);
-		}
+		if ((m_vpactive >> i) & 1ULL)
+			results.push_back(VantagePoint(i));
 	}
-	
-	for (int j=0;j < (int)m_points.size();j++){
-		bool skip = false;
-		if (!m_points[j]->active) continue;
-		
-		for (int i=0;i<m_nvps;i++){
-			if (!(m_pdists[i][j] >= qdists[i] - radius) && (m_pdists[i][j] <= qdists[i] + radius)){
-				skip = true;
-				break;
-			}
-		}
-		if (!skip){
-			double d = PointDistance(m_points[j], &target);
-			if (d <= radius){
-				QueryResult item;
-				item.dp = m_points[j];
-				item.distance = d;
-				InsertItemIntoList(results, item);
-			}
-		}
+	for (int j=0;j<m_npoints;j++){
+		if ((m_active[j/64] >> (j%64)) & 1ULL)
+			results.push_back(LeafPoint(j));
 	}
+	return results;
 }
 
-const vector<DataPoint*> MVPLeaf::PurgeDataPoints(){
-	vector<DataPoint*> results;
-	for (int i=0;i<m_nvps;i++){
-		if (!m_vps[i]->active)
-			delete m_vps[i];
-		else
-			results.push_back(m_vps[i]);
-	}
-	for (DataPoint *dp : m_points){
-		if (!dp->active)
-			delete dp;
-		else
-			results.push_back(dp);
-	}
-	return results;
+template<class M>
+size_t MVPLeaf<M>::MemoryUsage()const{
+	size_t n_bytes = sizeof(MVPLeaf<M>);
+	if (m_values != NULL)
+		n_bytes += BlockSize(m_nvps, m_npath, m_npoints) + MVP_CACHELINE + sizeof(void*);
+	return n_bytes;
+}
+
+template<class M>
+size_t MVPLeaf<M>::FrozenSize()const{
+	return sizeof(MVPFrozenLeafT<MVPDefaultLayout, M>) + BlockSize(m_nvps, m_npath, m_npoints);
+}
+
+template<class M>
+void MVPLeaf<M>::WriteFrozen(void *rec, const uint32_t*)const{
+	MVPFrozenLeafT<MVPDefaultLayout, M> *node = (MVPFrozenLeafT<MVPDefaultLayout, M>*)rec;
+	node->hdr.tag = MVP_LEAF;
+	node->hdr.nvps = m_nvps;
+	node->hdr.npath = m_npath;
+	node->hdr.npoints = m_npoints;
+	node->hdr.serial = this->m_serial;
+	node->vpactive = m_vpactive;
+	for (int w=0;w<MVP_LEAFMASKWORDS;w++) node->active[w] = m_active[w];
+	if (m_values != NULL)
+		memcpy((void*)node->Values(), m_values, BlockSize(m_nvps, m_npath, m_npoints));
 }
 
+#define MVP_INSTANTIATE_NODES(W) \
+	template class MVPNode<HammingMetric<W>>; \
+	template class MVPInternal<HammingMetric<W>>; \
+	template class MVPLeaf<HammingMetric<W>>;
 
+MVP_FOR_EACH_HASH_WORDS(MVP_INSTANTIATE_NODES)
@@ -3,135 +3,343 @@
 
 #include <cstring>
 #include <map>
+#include <list>
 #include <vector>
 #include <cmath>
 #include <algorithm>
 #include <stdexcept>
+#include <random>
 #include "datapoint.hpp"
+#include "mvparena.hpp"
+#include "metric.hpp"
 
 using namespace std;
 
+/* Point on its way down the tree as it is built, with its distances to */
+/* the vantage points of the nearest npath internal nodes it was routed */
+/* through, the nearest first, for its leaf to keep.  Only the buffers  */
+/* of points being built carry them.                                    */
+template<class M>
+struct MVPBuildPoint {
+	typedef typename M::PointType Point;
+
+	Point point;
+	unsigned char npath;
+	typename M::SplitType path[MVP_LEAFPATH][MVP_LEVELSPERNODE];
+
+	MVPBuildPoint():point(),npath(0){}
+
+	MVPBuildPoint(const Point &point):point(point),npath(0){}
+
+	/* make room for the distances to the next node's vantage points, */
+	/* those of the farthest dropping off once MVP_LEAFPATH are held  */
+	void PushPath(){
+		int n = min<int>(npath, MVP_LEAFPATH - 1);
+		memmove(path[1], path[0], n*sizeof(path[0]));
+		npath = n + 1;
+	}
+};
+
+/* Nodes carry their kind as a tag, and the node interface dispatches */
+/* on it to the derived class directly rather than through virtual    */
+/* calls.  Distances between points are given by the metric policy M. */
+template<class M>
 class MVPNode {
+protected:
+	const int m_type;     /* MVP_INTERNAL or MVP_LEAF                      */
+	uint32_t m_offset;    /* node's record in the frozen arena, 0 if none */
+	bool m_modified;      /* changed since its record was written          */
+	uint32_t m_serial;    /* order of creation, see MVPNodeSerial          */
+
+	MVPNode(const int type):m_type(type),m_offset(0),m_modified(true),m_serial(MVPNodeSerial::Next()){}
+
 public:
-	MVPNode(){}
+	typedef typename M::PointType Point;
+	typedef MVPBuildPoint<M> BuildPoint;
 
 	virtual ~MVPNode(){};
 
-	static MVPNode* CreateNode(vector<DataPoint*> &points,
-							   map<int,vector<DataPoint*>*> &childpoints,
-							   int level, int index);
+	static MVPNode<M>* CreateNode(vector<BuildPoint> &points,
+							   map<int,vector<BuildPoint>*> &childpoints,
+							   int level, unsigned long long key);
+
+	int GetType()const{ return m_type; }
+
+	bool IsLeaf()const{ return m_type == MVP_LEAF; }
+
+	MVPNode<M>* AddDataPoints(vector<BuildPoint> &points,
+						   map<int,vector<BuildPoint>*> &childpoints,
+						   const int level, const unsigned long long key);
+
+	const int GetCount()const;
+
+	void SetChildNode(const int n, MVPNode<M> *node);
+
+	MVPNode<M>* GetChildNode(const int n)const;
 
-	void InsertItemIntoList(list<QueryResult> &list, QueryResult &item)const;
-	
-	virtual MVPNode* AddDataPoints(vector<DataPoint*> &points,
-								   map<int,vector<DataPoint*>*> &childpoints,
-								   const int level, const int index) = 0;
+	const vector<Point> GetVantagePoints()const;
 
-	virtual const int GetCount()const = 0;
+	const vector<Point> GetDataPoints()const;
 
-	virtual void SetChildNode(const int n, MVPNode *node) = 0;
+	/* mark the point inactive if held active in this node and return true, otherwise
+	   return false with the index of the child node it was routed to in child,
+	   or -1 if there is no such child. */
+	bool DeactivatePoint(const Point &dp, int &child);
 
-	virtual MVPNode* GetChildNode(int n)const = 0;
+	/* the active points, with their path distances as held */
+	const vector<BuildPoint> PurgeDataPoints();
 
-	virtual const vector<DataPoint*> GetVantagePoints()const = 0;
-	
-	virtual const vector<DataPoint*> GetDataPoints()const = 0;
+	/* true if the node's split points have gone stale, see MVPInternal */
+	bool IsUnbalanced()const;
 
-	virtual const vector<DataPoint*> FilterDataPoints(const DataPoint *target, const double radius)const = 0;
+	size_t MemoryUsage()const;
 
-	virtual void TraverseNode(const DataPoint &target,
-							  const double radius,
-							  map<int, MVPNode*> &childnodes,
-							  const int index,
-							  list<QueryResult> &results)const = 0;
+	/* size of the node's record in the frozen arena */
+	size_t FrozenSize()const;
 
-	virtual const vector<DataPoint*> PurgeDataPoints()=0;
+	/* write the node's record, given its children's offsets */
+	void WriteFrozen(void *rec, const uint32_t *childoffsets)const;
 
+	uint32_t GetOffset()const{ return m_offset; }
+
+	void SetOffset(const uint32_t offset){ m_offset = offset; }
+
+	bool IsModified()const{ return m_modified; }
+
+	void SetModified(const bool modified){ m_modified = modified; }
+
+	/* serial anew, as for a node put in place of another's subtree */
+	void Renew(){ m_serial = MVPNodeSerial::Next(); m_modified = true; }
 };
 
-class MVPInternal : public MVPNode {
+template<class M>
+class MVPInternal final : public MVPNode<M> {
 private:
+	typedef typename M::PointType Point;
+	typedef MVPBuildPoint<M> BuildPoint;
+	typedef typename M::DistanceType DistanceType;
+	typedef typename M::SplitType SplitType;
+	typedef typename M::SummaryType SummaryType;
+
 	int m_nvps;
-	DataPoint* m_vps[MVP_LEVELSPERNODE];
-	MVPNode* m_childnodes[MVP_FANOUT];
-	double m_splits[MVP_LEVELSPERNODE][MVP_NUMSPLITS];
-
-	void SelectVantagePoints(vector<DataPoint*> &points);
-	
-	void CalcSplitPoints(const vector<double> &dists, int n, int split_index);
-
-	vector<double> CalcPointDistances(DataPoint &vp, vector<DataPoint*> &points);
-
-	vector<DataPoint*>* CullPoints(vector<DataPoint*> &list, vector<double> &dists,
-								  double split, bool less);
-		
-	void CollatePoints(vector<DataPoint*> &points,
-					   map<int, vector<DataPoint*>*> &childpoints,
-					   const int level, const int index);
-	
+	Point m_vps[MVP_LEVELSPERNODE];
+	MVPNode<M>* m_childnodes[MVP_FANOUT];
+	SplitType m_splits[MVP_LEVELSPERNODE][MVP_NUMSPLITS];
+
+	/* summaries of the points routed to each child, never narrowed on */
+	/* deletion, so that they still bound the child's subtree          */
+	SummaryType m_summaries[MVP_FANOUT];
+
+	/* least and greatest distances of the points routed to each child */
+	/* from each vantage point, likewise never narrowed                */
+	SplitType m_mindists[MVP_FANOUT][MVP_LEVELSPERNODE];
+	SplitType m_maxdists[MVP_FANOUT][MVP_LEVELSPERNODE];
+
+	/* no. active points in each child's subtree, and in the node's when */
+	/* its split points were first set                                   */
+	int m_counts[MVP_FANOUT];
+	int m_buildcount;
+
+	void SelectVantagePoints(vector<BuildPoint> &points, mt19937_64 &rng);
+
+	void CalcSplitPoints(const int *counts, const int n_dists, int n, int split_index);
+
+	void CollatePoints(vector<BuildPoint> &points,
+					   map<int, vector<BuildPoint>*> &childpoints);
+
+	void MarkChildBounds(const int child, const vector<BuildPoint> &points);
+
 public:
 	MVPInternal();
 	~MVPInternal(){};
-	MVPNode* AddDataPoints(vector<DataPoint*> &points,
-						   map<int,vector<DataPoint*>*> &childpoints,
-						   const int level, const int index);
+	MVPNode<M>* AddDataPoints(vector<BuildPoint> &points,
+						   map<int,vector<BuildPoint>*> &childpoints,
+						   const int level, const unsigned long long key);
 
 	const int GetCount()const;
 
-	void SetChildNode(const int n, MVPNode *node);
+	void SetChildNode(const int n, MVPNode<M> *node);
+
+	MVPNode<M>* GetChildNode(const int n)const;
+
+	const vector<Point> GetVantagePoints()const;
+
+	const vector<Point> GetDataPoints()const;
+
+	bool DeactivatePoint(const Point &dp, int &child);
 
-	MVPNode* GetChildNode(const int n)const;
+	/* take a point deactivated in child's subtree off its count */
+	void CountDeactivated(const int child){ if (m_counts[child] > 0) m_counts[child]--; }
 
-	const vector<DataPoint*> GetVantagePoints()const;
-	
-	const vector<DataPoint*> GetDataPoints()const;
+	/* no. points in the node's subtree, at most */
+	long long GetSubtreeCount()const;
 
-	const vector<DataPoint*> FilterDataPoints(const DataPoint *target, const double radius)const;
+	/* the child a point is routed to by the splits */
+	int RouteChild(const Point &dp)const;
 
-	void TraverseNode(const DataPoint &target,const double radius,
-							  map<int, MVPNode*> &childnodes,
-							  const int index,
-							  list<QueryResult> &results)const;
+	const vector<BuildPoint> PurgeDataPoints();
 
-	const vector<DataPoint*> PurgeDataPoints();
+	/* count the node's subtree as built from n_points, for a node whose */
+	/* points are added a chunk at a time                                */
+	void SetBuildCount(const int n_points){ m_buildcount = n_points; }
+
+	/* Splits set from the first points to reach the node route later   */
+	/* points unevenly if they are not like the first.  The node is      */
+	/* unbalanced once its subtree has grown to at least MVP_REBUILDMIN  */
+	/* points and twice what it held when its splits were set, and one   */
+	/* child holds more than MVP_IMBALANCE times its share of them.      */
+	bool IsUnbalanced()const;
+
+	size_t MemoryUsage()const;
+
+	size_t FrozenSize()const;
+
+	void WriteFrozen(void *rec, const uint32_t *childoffsets)const;
 };
 
-class MVPLeaf : public MVPNode {
+template<class M>
+class MVPLeaf final : public MVPNode<M> {
 private:
+	typedef typename M::PointType Point;
+	typedef MVPBuildPoint<M> BuildPoint;
+	typedef typename M::DistanceType DistanceType;
+
 	int m_nvps;
-	DataPoint* m_vps[MVP_PATHLENGTH];
-	double m_pdists[MVP_PATHLENGTH][MVP_LEAFCAP];
-	vector<DataPoint*> m_points;
+	int m_npath;
+	int m_npoints;
 
-	void SelectVantagePoints(vector<DataPoint*> &points);
+	/* leaf points in structure-of-arrays form, held in one cache-line    */
+	/* aligned block sized to the leaf's occupancy:                       */
+	/*   values[npoints][words] ids[npoints]                              */
+	/*   vpvalues[nvps][words] vpids[nvps] pdists[nvps+npath][npoints]    */
+	/*   vppaths[nvps][npath]                                             */
+	/* the first nvps rows of pdists are distances to the leaf's vantage  */
+	/* points, the last npath to those of its nearest npath/LPN internal  */
+	/* ancestors in order of depth, the points' path distances; vppaths   */
+	/* holds the vantage points' own.  Both are divided by the metric's   */
+	/* PivotScale to fit a byte.  active flags are kept as bitmasks       */
+	unsigned long long *m_values;
+	long long *m_ids;
+	unsigned long long *m_vpvalues;
+	long long *m_vpids;
+	unsigned char *m_pdists;
+	unsigned char *m_vppaths;
+	unsigned long long m_active[MVP_LEAFMASKWORDS];
+	unsigned long long m_vpactive;
+
+	static size_t BlockSize(const int nvps, const int npath, const int npoints);
+
+	void ResizeBlock(const int nvps, const int npoints, const int npath);
+
+	BuildPoint VantagePoint(const int i)const;
+
+	BuildPoint LeafPoint(const int j)const;
+
+	void SelectVantagePoints(vector<BuildPoint> &points, mt19937_64 &rng);
+
+	void MarkLeafDistances(const int start);
+
+	void AppendDataPoints(vector<BuildPoint> &points);
 
-	void MarkLeafDistances(vector<DataPoint*> &points);
-	
 public:
 	MVPLeaf();
-	~MVPLeaf(){};
-	MVPNode* AddDataPoints(vector<DataPoint*> &points,
-						   map<int,vector<DataPoint*>*> &childpoints,
-						   const int level, const int index);
+	~MVPLeaf();
+	MVPNode<M>* AddDataPoints(vector<BuildPoint> &points,
+						   map<int,vector<BuildPoint>*> &childpoints,
+						   const int level, const unsigned long long key);
 
 	const int GetCount()const;
 
-	void SetChildNode(const int n, MVPNode *node);
+	void SetChildNode(const int n, MVPNode<M> *node);
+
+	MVPNode<M>* GetChildNode(const int n)const;
 
-	MVPNode* GetChildNode(const int n)const;
+	const vector<Point> GetVantagePoints()const;
 
-	const vector<DataPoint*> GetVantagePoints()const;
+	const vector<Point> GetDataPoints()const;
 
-	const vector<DataPoint*> GetDataPoints()const;
+	bool DeactivatePoint(const Point &dp, int &child);
 
-	const vector<DataPoint*> FilterDataPoints(const DataPoint *target, const double radius)const;
+	const vector<BuildPoint> PurgeDataPoints();
 
-	void TraverseNode(const DataPoint &target,const double radius,
-					  map<int, MVPNode*> &childnodes,
-					  const int index,
-					  list<QueryResult> &results)const;
+	size_t MemoryUsage()const;
 
-	const vector<DataPoint*> PurgeDataPoints();
+	size_t FrozenSize()const;
+
+	void WriteFrozen(void *rec, const uint32_t *childoffsets)const;
 };
 
+/********** MVPNode dispatch *******************/
+
+#define MVP_DISPATCH(call) \
+	((m_type == MVP_INTERNAL) ? static_cast<MVPInternal<M>*>(this)->call : static_cast<MVPLeaf<M>*>(this)->call)
+
+#define MVP_DISPATCH_CONST(call) \
+	((m_type == MVP_INTERNAL) ? static_cast<const MVPInternal<M>*>(this)->call : static_cast<const MVPLeaf<M>*>(this)->call)
+
+template<class M>
+inline MVPNode<M>* MVPNode<M>::AddDataPoints(vector<BuildPoint> &points,
+									   map<int,vector<BuildPoint>*> &childpoints,
+									   const int level, const unsigned long long key){
+	return MVP_DISPATCH(AddDataPoints(points, childpoints, level, key));
+}
+
+template<class M>
+inline const int MVPNode<M>::GetCount()const{
+	return MVP_DISPATCH_CONST(GetCount());
+}
+
+template<class M>
+inline void MVPNode<M>::SetChildNode(const int n, MVPNode<M> *node){
+	if (m_type == MVP_INTERNAL) static_cast<MVPInternal<M>*>(this)->SetChildNode(n, node);
+}
+
+template<class M>
+inline MVPNode<M>* MVPNode<M>::GetChildNode(const int n)const{
+	return (m_type == MVP_INTERNAL) ? static_cast<const MVPInternal<M>*>(this)->GetChildNode(n) : NULL;
+}
+
+template<class M>
+inline bool MVPNode<M>::IsUnbalanced()const{
+	return (m_type == MVP_INTERNAL) ? static_cast<const MVPInternal<M>*>(this)->IsUnbalanced() : false;
+}
+
+template<class M>
+inline const vector<typename M::PointType> MVPNode<M>::GetVantagePoints()const{
+	return MVP_DISPATCH_CONST(GetVantagePoints());
+}
+
+template<class M>
+inline const vector<typename M::PointType> MVPNode<M>::GetDataPoints()const{
+	return MVP_DISPATCH_CONST(GetDataPoints());
+}
+
+template<class M>
+inline bool MVPNode<M>::DeactivatePoint(const Point &dp, int &child){
+	return MVP_DISPATCH(DeactivatePoint(dp, child));
+}
+
+template<class M>
+inline const vector<MVPBuildPoint<M>> MVPNode<M>::PurgeDataPoints(){
+	return MVP_DISPATCH(PurgeDataPoints());
+}
+
+template<class M>
+inline size_t MVPNode<M>::MemoryUsage()const{
+	return MVP_DISPATCH_CONST(MemoryUsage());
+}
+
+template<class M>
+inline size_t MVPNode<M>::FrozenSize()const{
+	return MVP_DISPATCH_CONST(FrozenSize());
+}
+
+template<class M>
+inline void MVPNode<M>::WriteFrozen(void *rec, const uint32_t *childoffsets)const{
+	MVP_DISPATCH_CONST(WriteFrozen(rec, childoffsets));
+}
+
+#undef MVP_DISPATCH
+#undef MVP_DISPATCH_CONST
+
 #endif /* _MVPNODE_H */
@@ -0,0 +1,77 @@
+#include <thread>
+#include <chrono>
+#include "mvppool.hpp"
+
+/* deque of the pool thread running on this thread, -1 if none */
+static thread_local int t_worker = -1;
+
+MVPWorkPool::MVPWorkPool(const int n_threads):m_nthreads(max(n_threads, 1)),m_pending(0){
+	for (int i=0;i<m_nthreads;i++) m_queues.emplace_back(new TaskQueue());
+}
+
+bool MVPWorkPool::Pop(const int worker, Task &task){
+	TaskQueue &queue = *m_queues[worker];
+	lock_guard<mutex> guard(queue.lock);
+	if (queue.tasks.empty()) return false;
+	task = move(queue.tasks.back());
+	queue.tasks.pop_back();
+	return true;
+}
+
+bool MVPWorkPool::Steal(const int worker, Task &task){
+	for (int k=1;k<m_nthreads;k++){
+		TaskQueue &queue = *m_queues[(worker + k) % m_nthreads];
+		lock_guard<mutex> guard(queue.lock);
+		if (!queue.tasks.empty()){
+			task = move(queue.tasks.front());
+			queue.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void MVPWorkPool::Work(const int worker){
+	int prev_worker = t_worker;
+	t_worker = worker;
+
+	int n_idle = 0;
+	while (m_pending.load() > 0){
+		Task task;
+		if (Pop(worker, task) || Steal(worker, task)){
+			try {
+				task();
+			} catch (...){
+				lock_guard<mutex> guard(m_errorlock);
+				if (!m_error) m_error = current_exception();
+			}
+			m_pending--;
+			n_idle = 0;
+		} else if (++n_idle < 64){
+			this_thread::yield();
+		} else {
+			this_thread::sleep_for(chrono::microseconds(50));
+		}
+	}
+
+	t_worker = prev_worker;
+}
+
+void MVPWorkPool::Submit(Task task){
+	int worker = (t_worker >= 0 && t_worker < m_nthreads) ? t_worker : 0;
+	m_pending++;
+	lock_guard<mutex> guard(m_queues[worker]->lock);
+	m_queues[worker]->tasks.push_back(move(task));
+}
+
+void MVPWorkPool::Run(Task task){
+	m_error = nullptr;
+	Submit(move(task));
+
+	vector<thread> threads;
+	for (int i=1;i<m_nthreads;i++) threads.emplace_back(&MVPWorkPool::Work, this, i);
+	Work(0);
+	for (thread &t : threads) t.join();
+
+	if (m_error) rethrow_exception(m_error);
+}
@@ -0,0 +1,56 @@
+#ifndef _MVPPOOL_H
+#define _MVPPOOL_H
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/* Work-stealing pool of threads for building subtrees in parallel.     */
+/* Tasks may submit further tasks.  Each thread keeps its own deque of  */
+/* tasks and takes the newest from the back, working depth first, and   */
+/* when it has none steals the oldest from the front of another's, in   */
+/* a build the tasks nearest the root and so with the most points.      */
+class MVPWorkPool {
+public:
+	typedef function<void()> Task;
+
+private:
+	struct TaskQueue {
+		mutex lock;
+		deque<Task> tasks;
+	};
+
+	int m_nthreads;
+	vector<unique_ptr<TaskQueue>> m_queues;
+	atomic<long> m_pending;    /* tasks submitted and not yet finished */
+
+	mutex m_errorlock;
+	exception_ptr m_error;
+
+	bool Pop(const int worker, Task &task);
+
+	bool Steal(const int worker, Task &task);
+
+	void Work(const int worker);
+
+public:
+	MVPWorkPool(const int n_threads);
+
+	/* run task, and all the tasks it submits, on the pool's threads, the */
+	/* calling thread among them.  Returns when all are done, rethrowing  */
+	/* the first exception thrown by any of them.                         */
+	void Run(Task task);
+
+	/* queue task on the calling thread's deque, from within a task */
+	void Submit(Task task);
+
+	int Threads()const{ return m_nthreads; }
+};
+
+#endif /* _MVPPOOL_H */
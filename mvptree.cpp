@@ -1,44 +1,60 @@
 #include <iostream>
-#include <typeinfo>
 #include <queue>
+#include <thread>
+#include <chrono>
 #include "mvptree.hpp"
 
 using namespace std;
 
-int MVPTree::n_ops = 0;
+thread_local int MVPOpCount::n_ops = 0;
 
-void MVPTree::LinkNodes(map<int, MVPNode*> &nodes, map<int, MVPNode*> &childnodes)const{
-	for (auto iter=nodes.begin();iter!=nodes.end();iter++){
-		int i = iter->first;
-		MVPNode *mvpnode = iter->second;
-		if (mvpnode != NULL){
-			for (int j=0;j<MVP_FANOUT;j++){
-				MVPNode *child = childnodes[i*MVP_FANOUT+j];
-				if (child != NULL) mvpnode->SetChildNode(j, child);
-			}
-		}
-	}
+template<class M>
+int MVPTree<M>::prefetch_distance = MVP_PREFETCHDIST;
+
+template<class M>
+int MVPTree<M>::vp_candidates = MVP_VPCANDIDATES;
+
+template<class M>
+unsigned long long MVPTree<M>::vp_seed = 0;
+
+template<class M>
+int MVPTree<M>::build_threads = MVP_BUILDTHREADS;
+
+template<class M>
+int MVPTree<M>::rebuild_slice = MVP_REBUILDSLICE;
+
+/* sort the ids appended to sorted ids from start into them, in time */
+/* linear in all of them                                             */
+static void MergeIds(vector<long long> &ids, const size_t start){
+	sort(ids.begin() + start, ids.end());
+	inplace_merge(ids.begin(), ids.begin() + start, ids.end());
 }
 
-void MVPTree::ExpandNode(MVPNode *node, map<int, MVPNode*> &childnodes,  const int index)const{
+/* key of child i of the node with key, a hash of the path to it */
+static inline unsigned long long ChildKey(const unsigned long long key, const int i){
+	return key*MVP_FANOUT + i + 1;
+}
+
+template<class M>
+void MVPTree<M>::ExpandNode(MVPNode<M> *node, vector<MVPNode<M>*> &childnodes)const{
 	if (node != NULL){
 		for (int i=0;i<MVP_FANOUT;i++){
-			MVPNode *child = node->GetChildNode(i);
-			if (child != NULL) childnodes[index*MVP_FANOUT+i] = child;
+			MVPNode<M> *child = node->GetChildNode(i);
+			if (child != NULL) childnodes.push_back(child);
 		}
 	}
 }
 
-MVPNode* MVPTree::ProcessNode(const int level, const int index,
-							  MVPNode *node,
-							  vector<DataPoint*> &points,
-							  map<int, MVPNode*> &childnodes,
-							  map<int, vector<DataPoint*>*> &childpoints){
-	MVPNode *retnode = node;
+template<class M>
+MVPNode<M>* MVPTree<M>::ProcessNode(const int level, const unsigned long long key,
+							  MVPNode<M> *node,
+							  vector<BuildPoint> &points,
+							  map<int, vector<BuildPoint>*> &childpoints){
+	MVPNode<M> *retnode = node;
 	if (node == NULL){ // create new node
-		retnode = MVPNode::CreateNode(points, childpoints, level, index);
+		retnode = MVPNode<M>::CreateNode(points, childpoints, level, key);
 	} else {           // node exists
-		retnode = node->AddDataPoints(points, childpoints, level, index);
+		retnode = node->AddDataPoints(points, childpoints, level, key);
 	}
 
 	if (retnode == NULL)
@@ -47,103 +63,461 @@ MVPNode* MVPTree::ProcessNode(const int level, const int index,
 	return retnode;
 }
 
-const DataPoint* MVPTree::Lookup(const long long id){
+template<class M>
+bool MVPTree<M>::Lookup(const long long id, Point &dp)const{
 	auto iter = m_ids.find(id);
 	if (iter != m_ids.end()){
-		return iter->second;
+		dp.id = iter->first;
+		dp.value = iter->second;
+		dp.active = true;
+		return true;
 	}
-	return NULL;
+	return false;
 }
 
-void MVPTree::Add(DataPoint *dp){
-	if (dp != NULL){
-		m_arrivals.push_back(dp);
-		if (m_arrivals.size() >= MVP_SYNC) Add(m_arrivals);
+template<class M>
+void MVPTree<M>::Add(const Point &dp){
+	m_arrivals.push_back(dp);
+	if (m_arrivals.size() >= MVP_SYNC){
+		Add(m_arrivals);
+		Rebalance(rebuild_slice);
 	}
 }
 
-void MVPTree::Add(vector<DataPoint*> &points){
+template<class M>
+void MVPTree<M>::Add(vector<Point> &points){
 	if (points.empty()) return;
 
-	for (DataPoint* dp : points) m_ids[dp->id] = dp;
+	for (Point &dp : points) m_ids[dp.id] = dp.value;
 
-	map<int, MVPNode*> prevnodes, currnodes, childnodes;
-	if (m_top != NULL) currnodes[0] = m_top;
+	vector<BuildPoint> buildpoints(points.begin(), points.end());
+	points.clear();
+	BuildItem top = {NULL, 0, &buildpoints, 0, 0};
 
-	map<int, vector<DataPoint*>*> pnts, pnts2;
-	pnts[0] = &points;
+	int n_threads = (build_threads > 0) ? build_threads : thread::hardware_concurrency();
+	if (n_threads > 1 && points.size() >= MVP_PARALLELMIN){
+		MVPWorkPool pool(n_threads);
+		pool.Run([this, &top, &pool](){ BuildSubtree(top, m_top, &pool); });
+	} else {
+		BuildSubtree(top, m_top, NULL);
+	}
+}
 
-	int n = 0;
-	do {
-		for (auto iter=pnts.begin();iter!=pnts.end();iter++){
-			int index = iter->first;
-			vector<DataPoint*> *list = iter->second;
-			MVPNode *mvpnode = currnodes[index];
-			MVPNode *newnode = ProcessNode(n, index, mvpnode, *list, childnodes, pnts2);
-			if (newnode != mvpnode){
-				if (newnode != NULL && typeid(*newnode).hash_code() == typeid(MVPInternal).hash_code()){
-					n_internal++;
-				} else if (typeid(*newnode).hash_code() == typeid(MVPLeaf).hash_code()){
-					n_leaf++;
-				}
-				if (mvpnode != NULL){
-					if (typeid(*mvpnode).hash_code() == typeid(MVPLeaf).hash_code()){
-						n_leaf--;
-					}
-					delete mvpnode;
+/* put newnode in the place of node, the child of item's parent or root */
+template<class M>
+void MVPTree<M>::ReplaceNode(const BuildItem &item, MVPNode<M> *node, MVPNode<M> *newnode, MVPNode<M> *&root){
+	if (item.parent != NULL) item.parent->SetChildNode(item.child, newnode);
+	else root = newnode;
+
+	lock_guard<mutex> guard(m_buildlock);
+	if (newnode->IsLeaf()){
+		n_leaf++;
+	} else {
+		n_internal++;
+	}
+	if (node != NULL){
+		if (node->IsLeaf()){
+			n_leaf--;
+		}
+		m_arena.Release(node->GetOffset());
+		delete node;
+	}
+}
+
+/* Add the points of the last of items to the subtree under it, and     */
+/* push items for those of its children.  The subtrees of a node's      */
+/* children are independent of one another, so with a pool those with   */
+/* enough points are handed to it to be built, or stolen, by other      */
+/* threads, and the rest left to this one.                              */
+template<class M>
+void MVPTree<M>::BuildStep(vector<BuildItem> &items, MVPNode<M> *&root, MVPWorkPool *pool){
+	BuildItem curr = items.back();
+	items.pop_back();
+
+	MVPNode<M> *mvpnode = (curr.parent != NULL) ? curr.parent->GetChildNode(curr.child) : root;
+	if (mvpnode != NULL && mvpnode == m_rebuild.oldroot){
+		lock_guard<mutex> guard(m_buildlock);
+		size_t start = m_rebuild.addedids.size();
+		for (const BuildPoint &bp : *curr.points){
+			m_rebuild.added.push_back(bp.point);
+			m_rebuild.addedids.push_back(bp.point.id);
+		}
+		MergeIds(m_rebuild.addedids, start);
+	}
+
+	map<int, vector<BuildPoint>*> childpoints;
+	MVPNode<M> *newnode = ProcessNode(curr.level, curr.key, mvpnode, *curr.points, childpoints);
+	if (newnode != mvpnode) ReplaceNode(curr, mvpnode, newnode, root);
+	newnode->SetModified(true);
+
+	if (rebuild_slice > 0 && m_rebuild.oldroot == NULL && newnode->IsUnbalanced()){
+		lock_guard<mutex> guard(m_buildlock);
+		m_unbalanced.push_back({newnode, curr.level, curr.key});
+	}
+
+	if (curr.parent != NULL) delete curr.points;
+
+	for (auto iter=childpoints.begin();iter!=childpoints.end();iter++){
+		BuildItem next = {newnode, iter->first, iter->second,
+						  curr.level + MVP_LEVELSPERNODE, ChildKey(curr.key, iter->first)};
+		if (pool != NULL && next.points->size() >= MVP_TASKMIN){
+			pool->Submit([this, next, &root, pool](){ BuildSubtree(next, root, pool); });
+		} else {
+			items.push_back(next);
+		}
+	}
+}
+
+/* Add the item's points to the subtree under it, root if the item has */
+/* no parent.  Only the nodes the points are routed through are         */
+/* visited, depth first.                                                */
+template<class M>
+void MVPTree<M>::BuildSubtree(const BuildItem &item, MVPNode<M> *&root, MVPWorkPool *pool){
+	vector<BuildItem> items = {item};
+	while (!items.empty()) BuildStep(items, root, pool);
+}
+
+/* retrace the point's route down from root to the node holding it, */
+/* and once it is found, take it off the counts of the children on   */
+/* the way                                                           */
+template<class M>
+void MVPTree<M>::DeactivatePoint(MVPNode<M> *root, const Point &dp){
+	vector<pair<MVPNode<M>*, int>> route;
+	MVPNode<M> *node = root;
+	while (node != NULL){
+		int child = -1;
+		node->SetModified(true);
+		if (node == m_rebuild.oldroot) m_rebuild.deleted.push_back(dp);
+		if (node->DeactivatePoint(dp, child)){
+			for (auto &step : route) static_cast<MVPInternal<M>*>(step.first)->CountDeactivated(step.second);
+			break;
+		}
+		if (child >= 0) route.push_back({node, child});
+		node = (child >= 0) ? node->GetChildNode(child) : NULL;
+	}
+}
+
+/* delete up to limit of the nodes, pushing their children in their place */
+template<class M>
+void MVPTree<M>::DeleteNodes(vector<MVPNode<M>*> &nodes, const size_t limit){
+	for (size_t n=0;n<limit && !nodes.empty();n++){
+		MVPNode<M> *node = nodes.back();
+		nodes.pop_back();
+		ExpandNode(node, nodes);
+		if (node->IsLeaf()){
+			n_leaf--;
+		} else {
+			n_internal--;
+		}
+		m_arena.Release(node->GetOffset());
+		delete node;
+	}
+}
+
+/* Begin rebuilding the subtree of the uppermost node found unbalanced, */
+/* the others being in it or left to be found again by later batches.   */
+/* The path down to it is found by routing one of its vantage points   */
+/* from the top, as splits once set route a point the same way always. */
+template<class M>
+bool MVPTree<M>::StartRebuild(){
+	if (m_unbalanced.empty()) return false;
+
+	Unbalanced node = m_unbalanced.front();
+	for (const Unbalanced &other : m_unbalanced){
+		if (other.level < node.level) node = other;
+	}
+	m_unbalanced.clear();
+
+	Point vp = node.node->GetVantagePoints().front();
+	vector<MVPNode<M>*> ancestors;
+	int child = 0;
+	MVPNode<M> *curr = m_top;
+	while (curr != NULL && curr != node.node && !curr->IsLeaf()){
+		ancestors.push_back(curr);
+		child = static_cast<MVPInternal<M>*>(curr)->RouteChild(vp);
+		curr = curr->GetChildNode(child);
+	}
+	if (curr != node.node) return false;
+
+	m_rebuild.oldroot = node.node;
+	m_rebuild.newroot = NULL;
+	m_rebuild.ancestors = move(ancestors);
+	m_rebuild.child = child;
+	m_rebuild.level = node.level;
+	m_rebuild.key = node.key;
+	m_rebuild.collect = {node.node};
+	m_rebuild.building = false;
+	m_rebuild.n_added = m_rebuild.n_deleted = m_rebuild.n_merged = 0;
+	// room for all the points to collect at the start, as growing a vector
+	// that large copies it all in one step
+	const long long n_points = static_cast<MVPInternal<M>*>(node.node)->GetSubtreeCount();
+	m_rebuild.points.reserve(n_points);
+	m_rebuild.builtids.reserve(n_points);
+	return true;
+}
+
+/* Collect the points of one internal node of the old subtree and of its */
+/* leaves, build one node of the new subtree, take the next chunk of the */
+/* points to add to it, or apply to it a chunk of the changes made to    */
+/* the old subtree meanwhile.  Points added to the old subtree since the */
+/* start are left out of the collected points, and added as changes.     */
+template<class M>
+void MVPTree<M>::RebuildStep(){
+	Rebuild &job = m_rebuild;
+	if (!job.collect.empty()){
+		MVPNode<M> *node = job.collect.back();
+		job.collect.pop_back();
+
+		// leaves are taken with their parent, as a leaf may be replaced
+		// by points added before a later step
+		vector<MVPNode<M>*> childnodes;
+		ExpandNode(node, childnodes);
+		childnodes.push_back(node);
+		for (MVPNode<M> *curr : childnodes){
+			if (curr != node && !curr->IsLeaf()){
+				job.collect.push_back(curr);
+				continue;
+			}
+			for (BuildPoint bp : curr->PurgeDataPoints()){
+				if (!binary_search(job.addedids.begin(), job.addedids.end(), bp.point.id)){
+					// paths set afresh by the nodes of the new subtree
+					bp.npath = 0;
+					job.points.push_back(bp);
+					job.builtids.push_back(bp.point.id);
 				}
-				if (n == 0) m_top = newnode;
 			}
-			currnodes[index] = newnode;
-			ExpandNode(newnode, childnodes, index);
-
-			if (n > 0) delete list;
 		}
+		// merged a chunk at a time, and the rest before the build
+		if (job.builtids.size() - job.n_merged >= MVP_REBUILDCHUNK){
+			MergeIds(job.builtids, job.n_merged);
+			job.n_merged = job.builtids.size();
+		}
+	} else if (!job.building){
+		MergeIds(job.builtids, job.n_merged);
+		// too few points left for an internal node, whose splits would
+		// set their path distances afresh
+		if (job.points.size() <= MVP_LEAFCAP + MVP_PATHLENGTH){
+			CancelRebuild();
+			return;
+		}
+		job.n_chunks = (job.points.size() + MVP_REBUILDCHUNK - 1)/MVP_REBUILDCHUNK;
+		job.n_built = 0;
+		job.building = true;
+	} else if (!job.items.empty()){
+		BuildStep(job.items, job.newroot, NULL);
+	} else if (job.n_built < job.n_chunks){
+		// every n_chunks'th point, so that the first chunk, which sets the
+		// splits of the new root, is a sample of the whole subtree
+		job.chunk.clear();
+		for (size_t i=job.n_built;i<job.points.size();i+=job.n_chunks) job.chunk.push_back(job.points[i]);
+		if (++job.n_built == job.n_chunks){
+			if (job.newroot != NULL && !job.newroot->IsLeaf())
+				static_cast<MVPInternal<M>*>(job.newroot)->SetBuildCount(job.points.size());
+			job.points = vector<BuildPoint>();
+		}
+		BuildItem top = {NULL, 0, &job.chunk, job.level, job.key};
+		job.items.push_back(top);
+	} else if (job.n_deleted < job.deleted.size()){
+		size_t end = min<size_t>(job.deleted.size(), job.n_deleted + MVP_REBUILDCHUNK);
+		// only those in the new subtree, lest the counts on their routes drop for points not there
+		for ( ;job.n_deleted<end;job.n_deleted++){
+			const Point &dp = job.deleted[job.n_deleted];
+			if (binary_search(job.builtids.begin(), job.builtids.end(), dp.id)) DeactivatePoint(job.newroot, dp);
+		}
+	} else if (job.n_added < job.added.size()){
+		// of the points added, those since deleted or replaced are left out
+		job.chunk.clear();
+		size_t start = job.builtids.size();
+		size_t end = min<size_t>(job.added.size(), job.n_added + MVP_REBUILDCHUNK);
+		for ( ;job.n_added<end;job.n_added++){
+			const Point &dp = job.added[job.n_added];
+			auto iter = m_ids.find(dp.id);
+			if (iter != m_ids.end() && iter->second == dp.value){
+				job.chunk.push_back(BuildPoint(dp));
+				job.builtids.push_back(dp.id);
+			}
+		}
+		MergeIds(job.builtids, start);
+		BuildItem top = {NULL, 0, &job.chunk, job.level, job.key};
+		if (!job.chunk.empty()) job.items.push_back(top);
+	} else {
+		FinishRebuild();
+	}
+}
 
-		if (!prevnodes.empty()) {
-			LinkNodes(prevnodes, currnodes);
+/* put the new subtree in the place of the old, all the changes made */
+/* to the old meanwhile having been applied to it, and leave the old  */
+/* to be deleted                                                      */
+template<class M>
+void MVPTree<M>::FinishRebuild(){
+	Rebuild &job = m_rebuild;
+	MVPNode<M> *oldroot = job.oldroot;
+	job.oldroot = NULL;
+
+	// built over many slices, so marked new as it goes in, for scans paused meanwhile
+	job.newroot->Renew();
+	MVPNode<M> *parent = job.ancestors.empty() ? NULL : job.ancestors.back();
+	if (parent != NULL) parent->SetChildNode(job.child, job.newroot);
+	else m_top = job.newroot;
+	for (MVPNode<M> *node : job.ancestors) node->SetModified(true);
+
+	job.newroot = NULL;
+	m_discard.push_back(oldroot);
+	m_rebuilds++;
+	CancelRebuild();
+}
+
+/* drop the rebuild under way, leaving the part of the new subtree */
+/* built to be deleted                                             */
+template<class M>
+void MVPTree<M>::CancelRebuild(){
+	Rebuild &job = m_rebuild;
+	for (BuildItem &item : job.items){
+		if (item.parent != NULL) delete item.points;
+	}
+	if (job.newroot != NULL) m_discard.push_back(job.newroot);
+	job.oldroot = job.newroot = NULL;
+	job.ancestors.clear();
+	job.collect.clear();
+	job.points = vector<BuildPoint>();
+	job.chunk = vector<BuildPoint>();
+	job.items.clear();
+	job.added = vector<Point>();
+	job.deleted.clear();
+	job.addedids = vector<long long>();
+	job.builtids = vector<long long>();
+}
+
+template<class M>
+bool MVPTree<M>::Rebalance(const int ms){
+	if (ms <= 0) return m_rebuild.oldroot != NULL || !m_discard.empty();
+
+	auto end = chrono::steady_clock::now() + chrono::milliseconds(ms);
+	do {
+		if (!m_discard.empty()){
+			DeleteNodes(m_discard, MVP_DISCARDCHUNK);
+			continue;
 		}
-		prevnodes = move(currnodes);
-		currnodes = move(childnodes);
-		pnts = move(pnts2);
-		childnodes.clear();
-		n += MVP_LEVELSPERNODE;
-	} while (!pnts.empty());
+		if (m_rebuild.oldroot == NULL && !StartRebuild()) return false;
+		RebuildStep();
+	} while (chrono::steady_clock::now() < end);
+	return m_rebuild.oldroot != NULL || !m_discard.empty();
 }
 
-void MVPTree::Sync(){
+template<class M>
+void MVPTree<M>::Sync(){
 	if (m_arrivals.size() > 0) {
 		Add(m_arrivals);
 	}
+	Rebalance(rebuild_slice);
+	Freeze();
+}
+
+template<class M>
+void MVPTree<M>::FreezeAll()const{
+	// records of the nodes yet to delete go with the reset, so that
+	// releasing them later does not count whatever is laid out there since
+	vector<MVPNode<M>*> stale(m_discard.begin(), m_discard.end());
+	while (!stale.empty()){
+		MVPNode<M> *node = stale.back();
+		stale.pop_back();
+		node->SetOffset(0);
+		ExpandNode(node, stale);
+	}
+	m_arena.Reset();
+
+	queue<MVPNode<M>*> nodes;
+	m_top->SetOffset(m_arena.Allocate(m_top->FrozenSize()));
+	nodes.push(m_top);
+
+	while (!nodes.empty()){
+		MVPNode<M> *node = nodes.front();
+		nodes.pop();
+
+		// allocate all children together, so that siblings are contiguous
+		uint32_t childoffsets[MVP_FANOUT];
+		for (int i=0;i<MVP_FANOUT;i++){
+			MVPNode<M> *child = node->GetChildNode(i);
+			childoffsets[i] = 0;
+			if (child != NULL){
+				child->SetOffset(m_arena.Allocate(child->FrozenSize()));
+				childoffsets[i] = child->GetOffset();
+				nodes.push(child);
+			}
+		}
+
+		node->WriteFrozen(m_arena.At(node->GetOffset()), childoffsets);
+		node->SetModified(false);
+	}
+
+	m_arena.SetRoot(m_top->GetOffset());
+}
+
+template<class M>
+uint32_t MVPTree<M>::FreezeNode(MVPNode<M> *node)const{
+	if (!node->IsModified() && node->GetOffset() != 0) return node->GetOffset();
+
+	uint32_t childoffsets[MVP_FANOUT];
+	for (int i=0;i<MVP_FANOUT;i++){
+		MVPNode<M> *child = node->GetChildNode(i);
+		childoffsets[i] = (child != NULL) ? FreezeNode(child) : 0;
+	}
+
+	m_arena.Release(node->GetOffset());
+	node->SetOffset(m_arena.Allocate(node->FrozenSize()));
+	node->WriteFrozen(m_arena.At(node->GetOffset()), childoffsets);
+	node->SetModified(false);
+	return node->GetOffset();
+}
+
+template<class M>
+void MVPTree<M>::Freeze()const{
+	if (m_top == NULL){
+		m_arena.Clear();
+		return;
+	}
+
+	if (m_arena.GetRoot() == 0 || 2*m_arena.Garbage() > m_arena.Used()){
+		FreezeAll();
+	} else if (m_top->IsModified()){
+		m_arena.SetRoot(FreezeNode(m_top));
+	}
 }
 
-void MVPTree::Delete(const long long id){
+template<class M>
+void MVPTree<M>::Delete(const long long id){
 	auto iter = m_ids.find(id);
-	if (iter != m_ids.end()) iter->second->active = false;
-	m_ids.erase(id);
+	if (iter == m_ids.end()) return;
+
+	Point dp(iter->first, iter->second);
+	m_ids.erase(iter);
+
+	DeactivatePoint(m_top, dp);
 }
 
-const int MVPTree::Size()const{
+template<class M>
+const int MVPTree<M>::Size()const{
 	return m_ids.size();
 }
 
-void MVPTree::CountNodes(int &n_internal, int &n_leaf)const{
+template<class M>
+void MVPTree<M>::CountNodes(int &n_internal, int &n_leaf)const{
 	n_internal = n_leaf = 0;
 
-	queue<MVPNode*> nodes;
+	queue<MVPNode<M>*> nodes;
 	if (m_top != NULL) nodes.push(m_top);
 
 	while (!nodes.empty()){
-		MVPNode *curr_node = nodes.front();
+		MVPNode<M> *curr_node = nodes.front();
 
-		if (typeid(*curr_node).hash_code() == typeid(MVPInternal).hash_code()){
-			n_internal++;
-		} else {
+		if (curr_node->IsLeaf()){
 			n_leaf++;
+		} else {
+			n_internal++;
 		}
 	
 		for (int i=0;i<MVP_FANOUT;i++){
-			MVPNode *child = curr_node->GetChildNode(i);
+			MVPNode<M> *child = curr_node->GetChildNode(i);
 			if (child != NULL) nodes.push(child);
 		}
 		
@@ -151,127 +525,174 @@ void MVPTree::CountNodes(int &n_internal, int &n_leaf)const{
 	}
 }
 
-void MVPTree::Clear(){
-	map<int, MVPNode*> currnodes, childnodes;
-	if (m_top != NULL) currnodes[0] = m_top;
+template<class M>
+void MVPTree<M>::Clear(){
+	CancelRebuild();
+	m_unbalanced.clear();
+	DeleteNodes(m_discard, SIZE_MAX);
 
-	int n = 0, n_internal = 0, n_leaf = 0;
-	do {
-		int n_nodes = pow(MVP_BRANCHFACTOR, n);
-		int n_childnodes = pow(MVP_BRANCHFACTOR, n+MVP_LEVELSPERNODE);
-		for (auto iter=currnodes.begin();iter!=currnodes.end();iter++){
-			int index = iter->first;
-			MVPNode *mvpnode = iter->second;
-
-			if (mvpnode != NULL){
-				vector<DataPoint*> pts = mvpnode->PurgeDataPoints();
-				for (DataPoint *dp : pts){
-					delete dp;
-				}
-
-				ExpandNode(mvpnode, childnodes, index);
-				
-				if (typeid(*mvpnode).hash_code() == typeid(MVPInternal).hash_code()){
-					n_internal++;
-				} else {
-					n_leaf++;
-				}
+	vector<MVPNode<M>*> currnodes, childnodes;
+	if (m_top != NULL) currnodes.push_back(m_top);
 
-				delete mvpnode;
-			}
+	while (!currnodes.empty()){
+		for (MVPNode<M> *mvpnode : currnodes){
+			ExpandNode(mvpnode, childnodes);
+			delete mvpnode;
 		}
 		currnodes = move(childnodes);
-		n += MVP_LEVELSPERNODE;
-
-	} while (!currnodes.empty());
+		childnodes.clear();
+	}
 	m_top = NULL;
+	n_internal = n_leaf = 0;
+	m_rebuilds = 0;
 	m_ids.clear();
+	m_arena.Clear();
 }
 
-const list<QueryResult> MVPTree::Query(const DataPoint &target, const double radius) const{
-	list<QueryResult> results;
-	
-	map<int, MVPNode*> currnodes, childnodes;
-	if (m_top != NULL) currnodes[0] = m_top;
+template<class M>
+const list<typename MVPTree<M>::Result> MVPTree<M>::Query(const Point &target, const DistanceType radius,
+														 const int limit, const bool sorted, MVPBudget *budget,
+														 const MVPApprox *approx) const{
+	list<Result> results;
+
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
 
 	n_ops = 0;
-	int n = 0;
-	do {
-		int n_nodes = pow(MVP_BRANCHFACTOR, n);
-		int n_childnodes = pow(MVP_BRANCHFACTOR, n+MVP_LEVELSPERNODE);
-		
-		for (auto iter=currnodes.begin();iter!=currnodes.end();iter++){
-			int node_index = iter->first;
-			MVPNode *mvpnode = iter->second;
-			if (mvpnode != NULL){
-				mvpnode->TraverseNode(target, radius, childnodes, node_index, results);
-			}
-		}
-		currnodes = move(childnodes);
-		n += MVP_LEVELSPERNODE;
-	} while (!currnodes.empty());
+	if (limit > 0){
+		// nearest first, so that the first found are soon found
+		SearchArenaNearest<MVPDefaultLayout, M>(m_arena, target, limit, radius, sorted, results, budget, approx);
+	} else {
+		MVPResultList<DistanceType> sink(results);
+		SearchArena<MVPDefaultLayout, M>(m_arena, target, radius, prefetch_distance, sink, budget, approx);
+	}
+
+	return results;
+}
+
+template<class M>
+long long MVPTree<M>::Count(const Point &target, const DistanceType radius, const long long cap) const{
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
+
+	n_ops = 0;
+	MVPResultCount<DistanceType> sink(cap);
+	SearchArena<MVPDefaultLayout, M>(m_arena, target, radius, prefetch_distance, sink);
+
+	return (cap > 0) ? min(sink.count, cap) : sink.count;
+}
+
+template<class M>
+const list<typename MVPTree<M>::Result> MVPTree<M>::Scan(const Point &target, const DistanceType radius,
+														const int count, vector<int> &cursor,
+														uint32_t &since) const{
+	list<Result> results;
+
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
+
+	uint32_t now = MVPNodeSerial::last.load();
+	n_ops = 0;
+	MVPResultChunk<DistanceType> sink(results, max(count, 1));
+	SearchArenaResume<MVPDefaultLayout, M>(m_arena, target, radius, cursor.empty() ? now : since, cursor, sink);
+	since = now;
+
+	return results;
+}
+
+template<class M>
+const vector<long long> MVPTree<M>::Histogram(const Point &target, const DistanceType maxradius) const{
+	vector<long long> counts(max<DistanceType>(maxradius + 1, 0), 0);
+
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
+
+	n_ops = 0;
+	MVPResultHistogram<DistanceType> sink(counts);
+	SearchArena<MVPDefaultLayout, M>(m_arena, target, maxradius, prefetch_distance, sink);
+
+	return counts;
+}
+
+template<class M>
+const vector<list<typename MVPTree<M>::Result>> MVPTree<M>::Query(const vector<Point> &targets,
+																 const DistanceType radius) const{
+	vector<list<Result>> results;
+
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
+
+	n_ops = 0;
+	SearchArenaMulti<MVPDefaultLayout, M>(m_arena, targets, radius, prefetch_distance, results);
 
 	return results;
 }
 
-void MVPTree::Print()const{
-	map<int, MVPNode*> currnodes, childnodes;
-	if (m_top != NULL) currnodes[0] = m_top;
+template<class M>
+const list<typename MVPTree<M>::Result> MVPTree<M>::Nearest(const Point &target, const int k,
+														   const DistanceType maxradius) const{
+	list<Result> results;
+
+	if (m_top != NULL && (m_arena.GetRoot() == 0 || m_top->IsModified())) Freeze();
+
+	n_ops = 0;
+	SearchArenaNearest<MVPDefaultLayout, M>(m_arena, target, k, maxradius, true, results);
+
+	return results;
+}
+
+template<class M>
+void MVPTree<M>::Print()const{
+	vector<MVPNode<M>*> currnodes, childnodes;
+	if (m_top != NULL) currnodes.push_back(m_top);
 	else cout << "Tree is empty" << endl;
 
 	cout << "MVP Tree" << endl;
 	cout << "branch factor: " << MVP_BRANCHFACTOR << endl;
 	cout << "path length: " << MVP_PATHLENGTH << endl;
+	cout << "leaf path: " << MVP_LEAFPATH << endl;
 	cout << "leaf cap: " << MVP_LEAFCAP << endl;
 	cout << "no. vp's: " << MVP_LEVELSPERNODE << endl;
 
-	int n = 0, depth = 0;
-	bool done;
-	do {
-		done = true;
-		int n_nodes = pow(MVP_BRANCHFACTOR, n);
-		int n_childnodes = pow(MVP_BRANCHFACTOR, n+MVP_LEVELSPERNODE);
-
+	int n = 0;
+	while (!currnodes.empty()){
 		cout << "level=" << n << "  ";
-		for (auto iter=currnodes.begin();iter!=currnodes.end();iter++){
-			int index = iter->first;
-			MVPNode *mvpnode = iter->second;
-
+		for (size_t index=0;index<currnodes.size();index++){
+			MVPNode<M> *mvpnode = currnodes[index];
 			cout << "node " << index << " (" << mvpnode->GetCount() << " points) - ";
-
-			ExpandNode(mvpnode, childnodes, index);
+			ExpandNode(mvpnode, childnodes);
 		}
 		cout << endl;
 		currnodes = move(childnodes);
+		childnodes.clear();
 		n += MVP_LEVELSPERNODE;
-		if (!currnodes.empty()) done = false;
-	} while (!done);
+	}
 }
 
-size_t MVPTree::MemoryUsage()const{
-	map<int, MVPNode*> currnodes, childnodes;
-	if (m_top != NULL) currnodes[0] = m_top;
-
-	int n_points = m_ids.size();
-	int n_internal=0, n_leaf=0;
-	do {
-		for (auto iter=currnodes.begin();iter!=currnodes.end();iter++){
-			int index = iter->first;
-			MVPNode *node = iter->second;
-
-			if (typeid(*node).hash_code() == typeid(MVPInternal).hash_code())
-				n_internal++;
-			else
-				n_leaf++;
-			ExpandNode(node, childnodes, index);
+template<class M>
+size_t MVPTree<M>::MemoryUsage()const{
+	vector<MVPNode<M>*> currnodes, childnodes;
+	if (m_top != NULL) currnodes.push_back(m_top);
+
+	if (m_rebuild.newroot != NULL) currnodes.push_back(m_rebuild.newroot);
+	currnodes.insert(currnodes.end(), m_discard.begin(), m_discard.end());
+
+	size_t n_bytes = sizeof(MVPTree<M>) + m_arrivals.capacity()*sizeof(Point) + m_arena.MemoryUsage();
+	n_bytes += (m_rebuild.points.capacity() + m_rebuild.chunk.capacity())*sizeof(BuildPoint)
+		+ m_rebuild.added.capacity()*sizeof(Point);
+	n_bytes += m_ids.size()*(sizeof(long long) + sizeof(Hash));
+	while (!currnodes.empty()){
+		for (MVPNode<M> *node : currnodes){
+			n_bytes += node->MemoryUsage();
+			ExpandNode(node, childnodes);
 		}
 		currnodes = move(childnodes);
-	} while (!currnodes.empty());
+		childnodes.clear();
+	}
 	
-	return  n_points*sizeof(DataPoint) + n_internal*sizeof(MVPInternal)
-		+ n_leaf*sizeof(MVPLeaf) + sizeof(MVPLeaf);
+	return n_bytes;
 }
 
-const map<long long, DataPoint*> MVPTree::GetMap()const{
+template<class M>
+const map<long long, typename MVPTree<M>::Hash>& MVPTree<M>::GetMap()const{
 	return m_ids;
 }
+
+#define MVP_INSTANTIATE_TREE(W) template class MVPTree<HammingMetric<W>>;
+
+MVP_FOR_EACH_HASH_WORDS(MVP_INSTANTIATE_TREE)
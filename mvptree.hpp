@@ -2,53 +2,219 @@
 #define _MVPTREE_H
 
 #include <list>
+#include <set>
+#include <mutex>
 #include "mvpnode.hpp"
+#include "mvppool.hpp"
+#include "metric.hpp"
 
 using namespace std;
 
-class MVPTree {
+/* Count of the distances computed by the calling thread, so that builds */
+/* on other threads do not disturb it.  Held outside the tree template,  */
+/* where the thread local needs no per-instance initialisation.          */
+struct MVPOpCount {
+	static thread_local int n_ops;
+};
+
+/* Multi-vantage point tree over the metric policy M */
+template<class M>
+class MVPTree : public MVPOpCount {
+public:
+	typedef typename M::PointType Point;
+	typedef MVPBuildPoint<M> BuildPoint;
+	typedef HashValue<M::Words> Hash;
+	typedef typename M::DistanceType DistanceType;
+	typedef QueryResult<DistanceType> Result;
+
 private:
-	vector<DataPoint*> m_arrivals;
+	vector<Point> m_arrivals;
 	
-	map<long long, DataPoint*> m_ids;
+	map<long long, Hash> m_ids;
 	
-	MVPNode* m_top;
+	MVPNode<M>* m_top;
+
+	mutable MVPArena m_arena;
 
 	int n_internal, n_leaf;
+
+	/* guards the node counts and the arena while subtrees are built in parallel */
+	mutex m_buildlock;
+
+	/* points to add under child of parent, or at the root of the subtree */
+	/* being built if parent is NULL                                        */
+	struct BuildItem {
+		MVPNode<M> *parent;
+		int child;
+		vector<BuildPoint> *points;
+		int level;
+		unsigned long long key;
+	};
+
+	/* internal node found unbalanced, at level with key */
+	struct Unbalanced {
+		MVPNode<M> *node;
+		int level;
+		unsigned long long key;
+	};
+
+	/* Rebuild of the subtree under an unbalanced node, done in slices.  */
+	/* Its active points are collected, then a new subtree built from    */
+	/* them beside the old one, which goes on taking points added and    */
+	/* deleted, so that queries meanwhile run on it.  Those changes are   */
+	/* kept and applied to the new subtree before it replaces the old.   */
+	/* The points are added to the new subtree a chunk at a time, each a */
+	/* sample of them all, and the changes likewise, so that no step of  */
+	/* the work takes much longer than another.                          */
+	struct Rebuild {
+		MVPNode<M> *oldroot;              /* NULL if no rebuild under way */
+		MVPNode<M> *newroot;
+		vector<MVPNode<M>*> ancestors;    /* from the top to oldroot's parent */
+		int child, level;
+		unsigned long long key;
+		vector<MVPNode<M>*> collect;      /* internal nodes yet to collect points from */
+		vector<BuildPoint> points;
+		size_t n_chunks, n_built;         /* chunks of points, and those added so far */
+		vector<BuildPoint> chunk;         /* points of the chunk being added */
+		vector<BuildItem> items;          /* nodes of the new subtree yet to build */
+		bool building;
+		vector<Point> added, deleted;     /* points routed to oldroot since the start */
+		size_t n_added, n_deleted;        /* of those, the no. applied to newroot */
+		vector<long long> addedids;       /* sorted */
+		vector<long long> builtids;       /* ids of the points put in the new subtree, */
+		size_t n_merged;                  /* sorted up to n_merged */
+	};
+
+	vector<Unbalanced> m_unbalanced;
+
+	Rebuild m_rebuild;
+
+	/* nodes of replaced subtrees yet to delete, a step at a time */
+	vector<MVPNode<M>*> m_discard;
+
+	/* no. rebuilt subtrees put in place of unbalanced ones */
+	int m_rebuilds;
 	
-	void LinkNodes(map<int, MVPNode*> &nodes, map<int, MVPNode*> &childnodes)const;
-	void ExpandNode(MVPNode *node, map<int, MVPNode*> &childnodes, const int index)const;
-	MVPNode* ProcessNode(const int level, const int index, MVPNode *node, vector<DataPoint*> &points,
-						 map<int, MVPNode*> &childnodes, map<int, vector<DataPoint*>*> &childpoints);
+	void ExpandNode(MVPNode<M> *node, vector<MVPNode<M>*> &childnodes)const;
+	MVPNode<M>* ProcessNode(const int level, const unsigned long long key, MVPNode<M> *node,
+						 vector<BuildPoint> &points, map<int, vector<BuildPoint>*> &childpoints);
+	void ReplaceNode(const BuildItem &item, MVPNode<M> *node, MVPNode<M> *newnode, MVPNode<M> *&root);
+	void BuildStep(vector<BuildItem> &items, MVPNode<M> *&root, MVPWorkPool *pool);
+	void BuildSubtree(const BuildItem &item, MVPNode<M> *&root, MVPWorkPool *pool);
+	void DeactivatePoint(MVPNode<M> *root, const Point &dp);
+	void DeleteNodes(vector<MVPNode<M>*> &nodes, const size_t limit);
+	bool StartRebuild();
+	void RebuildStep();
+	void FinishRebuild();
+	void CancelRebuild();
+	void FreezeAll()const;
+	uint32_t FreezeNode(MVPNode<M> *node)const;
 public:
 
-	static int n_ops;
+	/* no. nodes ahead of a query's traversal whose records are prefetched */
+	static int prefetch_distance;
+
+	/* no. candidates drawn for each vantage point, and the seed of the */
+	/* draws, mixed with the position of the node in the tree          */
+	static int vp_candidates;
+	static unsigned long long vp_seed;
+
+	/* no. threads that large batches of points are built on, 0 for one */
+	/* per core                                                          */
+	static int build_threads;
 
-	MVPTree():m_top(NULL),n_internal(0),n_leaf(0){};
+	/* ms. of work on rebuilding unbalanced subtrees done with each batch */
+	/* of points added and each sync, 0 for none                          */
+	static int rebuild_slice;
 
-	const DataPoint* Lookup(const long long id);
+	MVPTree():m_top(NULL),n_internal(0),n_leaf(0),m_rebuilds(0){
+		m_rebuild.oldroot = m_rebuild.newroot = NULL;
+	};
+
+	bool Lookup(const long long id, Point &dp)const;
 	
-	void Add(DataPoint *dp);
+	void Add(const Point &dp);
 	
-	void Add(vector<DataPoint*> &points);
+	void Add(vector<Point> &points);
 
 	void Sync();
+
+	/* go on rebuilding unbalanced subtrees for up to ms. milliseconds, */
+	/* and return true if a rebuild is still under way                  */
+	bool Rebalance(const int ms);
+
+	/* bring the frozen arena that queries run on up to date with the tree */
+	void Freeze()const;
 	
 	void Delete(const long long id);
 
 	const int Size()const;
 
 	void CountNodes(int &n_internal, int &n_leaf)const;
+
+	/* no. unbalanced subtrees rebuilt and put in place so far */
+	int Rebuilds()const{ return m_rebuilds; }
 	
 	void Clear();
 
-	const list<QueryResult> Query(const DataPoint &target, const double radius) const;
+	/* points within radius of target in order of distance.  With a limit */
+	/* > 0, only the nearest limit of them, or if not sorted the first    */
+	/* limit found, the search stopping as soon as it has them.  Given a  */
+	/* budget, only those found before it is spent, and given approx,     */
+	/* those found by the relaxed search.                                 */
+	const list<Result> Query(const Point &target, const DistanceType radius, const int limit = 0,
+							 const bool sorted = true, MVPBudget *budget = NULL,
+							 const MVPApprox *approx = NULL) const;
+
+	/* no. points within radius of target, counting no further than cap */
+	/* if cap > 0                                                       */
+	long long Count(const Point &target, const DistanceType radius, const long long cap = 0) const;
+
+	/* no. points at each distance from target, 0 to maxradius */
+	const vector<long long> Histogram(const Point &target, const DistanceType maxradius) const;
+
+	/* next chunk of the points within radius of target, count of them or */
+	/* a node's worth more, in the order found.  cursor is the path of the */
+	/* search to resume from, empty to start, and is left at where to      */
+	/* resume next, empty once all are found.  since is the node serial    */
+	/* when the cursor was left, and is set to the serial now.  Points of  */
+	/* subtrees rebuilt in between may be given twice.  Throws             */
+	/* invalid_argument for a cursor that leads nowhere.                   */
+	const list<Result> Scan(const Point &target, const DistanceType radius, const int count,
+							vector<int> &cursor, uint32_t &since) const;
+
+	/* points within radius of each of targets, searched together */
+	const vector<list<Result>> Query(const vector<Point> &targets, const DistanceType radius) const;
+
+	/* the k points nearest target, within maxradius, in order of distance */
+	const list<Result> Nearest(const Point &target, const int k, const DistanceType maxradius) const;
 
 	void Print()const;
 
 	size_t MemoryUsage()const;
 
-	const map<long long, DataPoint*> GetMap()const;
+	const map<long long, Hash>& GetMap()const;
 };
 
+#define MVP_DECLARE_TREE(W) extern template class MVPTree<HammingMetric<W>>;
+
+MVP_FOR_EACH_HASH_WORDS(MVP_DECLARE_TREE)
+
+#undef MVP_DECLARE_TREE
+
+/* distances under metric M, counted in MVPTree<M>::n_ops */
+template<class M>
+inline typename M::DistanceType PointDistance(const typename M::PointType &a, const typename M::PointType &b){
+	MVPTree<M>::n_ops++;
+	return M::Distance(a, b);
+}
+
+/* distances from target to a block of n hash values */
+template<class M>
+inline void PointDistances(const typename M::PointType &target, const unsigned long long *values, const int n,
+						   typename M::DistanceType *dists){
+	MVPTree<M>::n_ops += n;
+	M::Distances(target, values, n, dists);
+}
+
 #endif /* _MVPTREE_H */